@@ -119,6 +119,16 @@ if test "$ac_mysql" = "yes"; then
 	fi
     MYSQL_LIBS=-lmysqlclient
 
+	# MariaDB Connector/C provides a non-blocking API which the
+	# driver uses if available
+	ac_mysql_save_CPPFLAGS="$CPPFLAGS"
+	ac_mysql_save_LIBS="$LIBS"
+	CPPFLAGS="$CPPFLAGS $MYSQL_INCLUDE"
+	LIBS="$MYSQL_LDFLAGS $MYSQL_LIBS $LIBS"
+	AC_CHECK_FUNCS([mysql_real_query_start])
+	CPPFLAGS="$ac_mysql_save_CPPFLAGS"
+	LIBS="$ac_mysql_save_LIBS"
+
 	AM_CONDITIONAL(HAVE_MYSQL, true)
 	
 	AC_SUBST(MYSQL_LIBS)
@@ -173,13 +183,23 @@ if test "$ac_pgsql" = "yes"; then
 		PGSQL_INCLUDE=-I$ac_pgsql_incdir
 	fi
 	if test "$ac_pgsql_libdir" = "no"; then
-		PGSQL_LDFLAGS=`pg_config --libdir`
+		PGSQL_LDFLAGS=-L`pg_config --libdir`
 	else
 		PGSQL_LDFLAGS=-L$ac_pgsql_libdir
 	fi
 
 	PGSQL_LIBS=-lpq
 
+	# newer libpq versions provide optional features which the
+	# driver uses if available
+	ac_pgsql_save_CPPFLAGS="$CPPFLAGS"
+	ac_pgsql_save_LIBS="$LIBS"
+	CPPFLAGS="$CPPFLAGS $PGSQL_INCLUDE"
+	LIBS="$PGSQL_LDFLAGS $PGSQL_LIBS $LIBS"
+	AC_CHECK_FUNCS([PQenterPipelineMode PQregisterEventProc lo_lseek64])
+	CPPFLAGS="$ac_pgsql_save_CPPFLAGS"
+	LIBS="$ac_pgsql_save_LIBS"
+
 
 	AM_CONDITIONAL(HAVE_PGSQL, true)
 	
@@ -45,6 +45,7 @@ long long strtoll(const char *nptr, char **endptr, int base);
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 
 #include <dbi/dbi.h>
@@ -52,8 +53,19 @@ long long strtoll(const char *nptr, char **endptr, int base);
 #include <dbi/dbd.h>
 
 #include <mysql/mysql.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include "dbd_mysql.h"
 
+#if MYSQL_VERSION_ID >= 80000 && !defined(MARIADB_BASE_VERSION)
+/* MySQL 8 uses bool in the MYSQL_BIND structure */
+typedef bool my_bool;
+#endif
+
 static const dbi_info_t driver_info = {
 	"mysql",
 	"MySQL database support (using libmysqlclient)",
@@ -110,7 +122,35 @@ static const char mysql_encoding_hash[][16] = {
 /* forward declarations of local functions */
 void _translate_mysql_type(MYSQL_FIELD *field, unsigned short *type, unsigned int *attribs);
 void _get_field_info(dbi_result_t *result);
+int _is_decimal_field(MYSQL_FIELD *field);
+long long _parse_decimal(const char *raw, size_t len, unsigned int scale);
 void _get_row_data(dbi_result_t *result, dbi_row_t *row, unsigned long long rowidx);
+int _check_busy(dbi_conn_t *conn);
+int _async_step(dbi_conn_t *conn, int status, int err, MYSQL_RES *res);
+unsigned long _get_max_packet(dbi_conn_t *conn);
+unsigned long _real_escape_string(MYSQL *mycon, char *dest, const char *src, unsigned long len);
+int _needs_real_escape(MYSQL *mycon);
+size_t _escape_string(const char *src, size_t len, char *dest);
+#ifdef HAVE_PTHREAD_H
+long long _stream_read_ahead(dbi_result_t *result, dbd_mysql_row_func callback, void *user_arg, unsigned int depth, int *stop);
+void *_read_ahead_thread(void *arg);
+#endif
+dbi_result_t *_create_result(dbi_conn_t *conn, MYSQL_RES *res);
+void _discard_results(MYSQL *mycon);
+int _is_call(const char *statement);
+int _tuple_fits(size_t sql_len, size_t tuple_len, size_t limit);
+int _append_tuple(char **sql_cmd, size_t *sql_len, size_t *sql_size, size_t prefix_len, const char *tuple, size_t tuple_len);
+int _infile_init(void **ptr, const char *filename, void *userdata);
+int _infile_read(void *ptr, char *buf, unsigned int buf_len);
+void _infile_end(void *ptr);
+int _infile_error(void *ptr, char *error_msg, unsigned int error_msg_len);
+int _format_infile_row(mysql_infile_t *infile);
+mysql_row_index_t *_get_row_index(dbi_result_t *result, int create);
+void _free_row_index(mysql_row_index_t *row_index);
+MYSQL_STMT *_get_stmt(dbi_conn_t *conn, const char *statement);
+void _drop_stmt(mysql_conn_data_t *conn_data, MYSQL_STMT *stmt);
+void _free_stmts(mysql_conn_data_t *conn_data);
+int _fetch_stmt_rows(dbi_result_t *result, MYSQL_STMT *stmt, MYSQL_FIELD *fields);
 
 
 
@@ -132,7 +172,10 @@ int dbd_initialize(dbi_driver_t *driver) {
 
 int dbd_connect(dbi_conn_t *conn) {
 	MYSQL *mycon;
+	mysql_conn_data_t *conn_data;
+#if MYSQL_VERSION_ID < 50007
 	char* sql_cmd;
+#endif
 	unsigned long client_flags = 0;
 
 	const char *host = dbi_conn_get_option(conn, "host");
@@ -159,8 +202,9 @@ int dbd_connect(dbi_conn_t *conn) {
 	client_flags |= (dbi_conn_get_option_numeric(conn, "mysql_client_no_schema") > 0) ? CLIENT_NO_SCHEMA : 0;
 	client_flags |= (dbi_conn_get_option_numeric(conn, "mysql_client_odbc") > 0) ? CLIENT_ODBC : 0;
 	
-	mycon = mysql_init(NULL);
-	if (!mycon) {
+	conn_data = calloc(1, sizeof(mysql_conn_data_t));
+	if (!conn_data || !(mycon = mysql_init(&conn_data->mysql))) {
+		free(conn_data);
 		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
 		return -2;
 	}
@@ -170,10 +214,23 @@ int dbd_connect(dbi_conn_t *conn) {
 	  mysql_options(mycon, MYSQL_OPT_CONNECT_TIMEOUT, (const char*) &timeout);
 	}
 
+	if (encoding && *encoding && strcmp(encoding, "auto")) {
+	  /* the encoding is sent with the handshake, this saves a SET
+	     NAMES round trip */
+	  mysql_options(mycon, MYSQL_SET_CHARSET_NAME, dbd_encoding_from_iana(encoding));
+	}
+
+	if (client_flags & CLIENT_LOCAL_FILES) {
+	  /* recent client libraries need this in addition to the flag */
+	  unsigned int local_infile = 1;
+	  mysql_options(mycon, MYSQL_OPT_LOCAL_INFILE, (const char*) &local_infile);
+	}
+
 	if (!mysql_real_connect(mycon, host, username, password, dbname, port, unix_socket, client_flags)) {
 		conn->connection = (void *)mycon; // still need this set so _error_handler can grab information
 		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
 		mysql_close(mycon);
+		free(conn_data);
 		conn->connection = NULL; // myconn no longer valid
 		return -2;
 	}
@@ -182,38 +239,42 @@ int dbd_connect(dbi_conn_t *conn) {
 		if (dbname) conn->current_db = strdup(dbname);
 	}
 /* 	printf("dbname went to %s\n", dbname);	 */
-	if (encoding && *encoding) {
-	  /* set connection encoding */
-	  if (!strcmp(encoding, "auto")) {
-	    encoding = dbd_get_encoding(conn);
-	    if (encoding) {
-	      asprintf(&sql_cmd, "SET NAMES '%s'", dbd_encoding_from_iana(encoding));
-/*  	      printf("SET NAMES '%s'\n", dbd_encoding_from_iana(encoding)); */
-	      dbd_query(conn, sql_cmd);
-	      free(sql_cmd);
-	    }
-/* 	    else { */
-/* 	      printf("could not retrieve encoding\n"); */
-/* 	    } */
-	    /* else: do nothing, use default */
-	  }
-	  else {
+	if (encoding && !strcmp(encoding, "auto")) {
+	  /* set connection encoding to the database encoding, unless the
+	     handshake already did */
+	  encoding = dbd_get_encoding(conn);
+	  if (encoding && strcmp(encoding, dbd_encoding_to_iana(mysql_character_set_name(mycon)))) {
+#if MYSQL_VERSION_ID >= 50007
+	    /* also tells the client library, which needs to know the
+	       encoding for mysql_real_escape_string() */
+	    mysql_set_character_set(mycon, dbd_encoding_from_iana(encoding));
+#else
 	    asprintf(&sql_cmd, "SET NAMES '%s'", dbd_encoding_from_iana(encoding));
-/*   	    printf("SET NAMES '%s'", dbd_encoding_from_iana(encoding)); */
-	    dbd_query(conn, sql_cmd);
+	    mysql_query(mycon, sql_cmd);
 	    free(sql_cmd);
+#endif
 	  }
-/*  	  printf("set encoding to %s<<\n", dbd_encoding_from_iana(encoding)); */
+	  /* else: do nothing, use default */
 	}
-/* 	else { */
-/* 	  printf("leave encoding alone\n"); */
-/* 	} */
 
 	return 0;
 }
 
 int dbd_disconnect(dbi_conn_t *conn) {
-	if (conn->connection) mysql_close((MYSQL *)conn->connection);
+	mysql_row_index_t *row_index;
+
+	if (conn->connection) {
+		/* the MYSQL handle is part of our driver data, see dbd_connect() */
+		_free_stmts((mysql_conn_data_t *)conn->connection);
+		mysql_free_result(((mysql_conn_data_t *)conn->connection)->async_res);
+		free(((mysql_conn_data_t *)conn->connection)->encoding);
+		while ((row_index = ((mysql_conn_data_t *)conn->connection)->row_indexes) != NULL) {
+			((mysql_conn_data_t *)conn->connection)->row_indexes = row_index->next;
+			_free_row_index(row_index);
+		}
+		mysql_close((MYSQL *)conn->connection);
+		free(conn->connection);
+	}
 	return 0;
 }
 
@@ -221,6 +282,9 @@ int dbd_fetch_row(dbi_result_t *result, unsigned long long rowidx) {
 	dbi_row_t *row = NULL;
 
 	if (result->result_state == NOTHING_RETURNED) return 0;
+
+	/* results of prepared statements come with all rows prefetched */
+	if (!result->result_handle) return 0;
 	
 	if (result->result_state == ROWS_RETURNED) {
 		/* get row here */
@@ -233,16 +297,48 @@ int dbd_fetch_row(dbi_result_t *result, unsigned long long rowidx) {
 }
 
 int dbd_free_query(dbi_result_t *result) {
+	_free_row_index(_get_row_index(result, 0));
 	if (result->result_handle) mysql_free_result((MYSQL_RES *)result->result_handle);
 	return 0;
 }
 
 int dbd_goto_row(dbi_result_t *result, unsigned long long rowidx) {
-	// XXX TODO: kosherize this, handle efficient queries.
-	mysql_data_seek((MYSQL_RES *)result->result_handle, rowidx);
-	/* the return type of this function is indeed void, so it is
-	   unclear what happens if rowidx is outside the range. The
-	   calling function must make sure the row index is valid */
+	MYSQL_RES *res = (MYSQL_RES *)result->result_handle;
+	mysql_row_index_t *row_index;
+	unsigned long long idx;
+
+	if (!res) return 1;
+
+	/* the calling function must make sure the row index is valid */
+	if ((row_index = _get_row_index(result, 1)) == NULL) {
+		/* walks the list of rows from the start */
+		mysql_data_seek(res, rowidx);
+		return 1;
+	}
+
+	/* libdbi calls this before fetching any row. Moving on to the
+	   next row needs no seek */
+	if (row_index->next_row != rowidx) {
+		if (!row_index->offsets
+		    && (row_index->offsets = malloc(result->numrows_matched * sizeof(MYSQL_ROW_OFFSET))) != NULL) {
+			/* remember where each row starts, so later jumps are
+			   cheap */
+			mysql_data_seek(res, 0);
+			for (idx = 0; idx < result->numrows_matched; idx++) {
+				row_index->offsets[idx] = mysql_row_tell(res);
+				mysql_fetch_row(res);
+			}
+		}
+		if (row_index->offsets) {
+			mysql_row_seek(res, row_index->offsets[rowidx]);
+		}
+		else {
+			mysql_data_seek(res, rowidx);
+		}
+	}
+
+	/* dbd_fetch_row() fetches the row right away */
+	row_index->next_row = rowidx+1;
 	return 1;
 }
 
@@ -252,119 +348,48 @@ int dbd_get_socket(dbi_conn_t *conn){
 }
 
 const char *dbd_get_encoding(dbi_conn_t *conn){
-	MYSQL *mycon = (MYSQL*)conn->connection;
-	const char* my_enc = NULL;
-	const char* iana_enc = NULL;
-	dbi_result dbires = NULL;
-	dbi_result dbires1 = NULL;
-	dbi_result dbires2 = NULL;
-	const char* schemastring;
+	mysql_conn_data_t *conn_data = (mysql_conn_data_t *)conn->connection;
 	const char* encodingopt;
-	char* sql_cmd;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+	if (!conn_data) return NULL;
 
-	if (!mycon) return NULL;
+	/* the encoding is looked up once per connection, and again only
+	   after dbd_select_db() */
+	if (conn_data->encoding) return conn_data->encoding;
 
-	/* quite a mess. Set the dbi option "encoding" to "auto" to get
-	   a behaviour similar to PostgreSQL where the default connection
-	   encoding is identical to the database encoding. If you do not 
-	   use this option, or if you explicitly requested a particular
-	   connection encoding, this encoding will be returned
-	   [it has been set in dbd_connect()]
+	/* Set the dbi option "encoding" to "auto" to get a behaviour
+	   similar to PostgreSQL where the default connection encoding is
+	   identical to the database encoding. If you do not use this
+	   option, or if you explicitly requested a particular connection
+	   encoding, this encoding will be returned [it has been set in
+	   dbd_connect()]
 	*/
 
 	encodingopt = dbi_conn_get_option(conn, "encoding");
-	if (encodingopt && !strcmp(encodingopt, "auto")) {
-	  asprintf(&sql_cmd, "SHOW CREATE DATABASE %s", conn->current_db);
-/* 	  printf("SHOW CREATE DATABASE %s", conn->current_db); */
-
-	  dbires = dbi_conn_query(conn, sql_cmd);
-
-	  if (dbires && dbi_result_next_row(dbires)) {
-	    /* 4.x apparently returns these values as binary, 5.x as string */
-	    if (dbi_result_get_field_type_idx(dbires, 2) == DBI_TYPE_STRING) {
-	      schemastring = dbi_result_get_string_idx(dbires, 2);
-	    }
-	    else {
-	      schemastring = dbi_result_get_binary_idx(dbires, 2);
-	    }
-
-	    if (schemastring && *schemastring) {
-	      my_enc = strstr(schemastring, "CHARACTER SET");
-/*   	      printf("schemastring:%s<<enc:%s<<\n", schemastring, my_enc); */
-	      if (my_enc) {
-		my_enc += 14; /* set to start of encoding name */	    }
-	    }
-	  }
-	}
-
-	if (!my_enc) {
-	  /* use connection encoding instead */
-	  asprintf(&sql_cmd, "SHOW VARIABLES LIKE '%s'", "character_set_connection");
-/* 	  printf("SHOW CREATE DATABASE %s", conn->current_db); */
-
-	  dbires1 = dbi_conn_query(conn, sql_cmd);
-
-	  if (dbires1 && dbi_result_next_row(dbires1)) {
-	    if (dbi_result_get_field_type_idx(dbires1, 2) == DBI_TYPE_STRING) {
-	      my_enc = dbi_result_get_string_idx(dbires1, 2);
-	    }
-	    else {
-	      my_enc = dbi_result_get_binary_idx(dbires1, 2);
-	    }
-	  }
-
-/* 	  my_enc = mysql_character_set_name(mycon); */
-/*   	  printf("mysql claims enc:%s<<\n", my_enc); */
-	  if (!my_enc) {
-	    /* this may be a pre-4.1 server w/o per-connection encoding */
-	    asprintf(&sql_cmd, "SHOW VARIABLES LIKE '%s'", "character_set");
-/* 	  printf("SHOW CREATE DATABASE %s", conn->current_db); */
-
-	    dbires2 = dbi_conn_query(conn, sql_cmd);
-
-
-	    if (dbires2 && dbi_result_next_row(dbires2)) {
-	      if (dbi_result_get_field_type_idx(dbires2, 2) == DBI_TYPE_STRING) {
-		my_enc = dbi_result_get_string_idx(dbires2, 2);
-	      }
-	      else {
-		my_enc = dbi_result_get_binary_idx(dbires2, 2);
-	      }
-	    }
+	if (encodingopt && !strcmp(encodingopt, "auto") && conn->current_db) {
+	  if (conn_data->busy) {
+	    /* the lookup has to wait until the pending query is done, so
+	       report the connection encoding without caching it */
+	    return dbd_encoding_to_iana(mysql_character_set_name(&conn_data->mysql));
 	  }
-
-	  free(sql_cmd);
-
-	  if (!my_enc) {
-	    if (dbires) {
-	      dbi_result_free(dbires);
-	    }
-	    if (dbires1) {
-	      dbi_result_free(dbires1);
+	  if (!mysql_query(&conn_data->mysql, "SELECT @@character_set_database")
+	      && (res = mysql_store_result(&conn_data->mysql)) != NULL) {
+	    if ((row = mysql_fetch_row(res)) != NULL && row[0]) {
+	      conn_data->encoding = strdup(dbd_encoding_to_iana(row[0]));
 	    }
-	    if (dbires2) {
-	      dbi_result_free(dbires1);
-	    }
-
-	    return NULL;
+	    mysql_free_result(res);
 	  }
 	}
 
-
-	iana_enc = dbd_encoding_to_iana(my_enc);
-	
-	if (dbires) {
-	  dbi_result_free(dbires);
-	}
-
-	if (dbires1) {
-	  dbi_result_free(dbires1);
-	}
-	if (dbires2) {
-	  dbi_result_free(dbires2);
+	if (!conn_data->encoding) {
+	  /* use connection encoding instead. The client library knows it
+	     from the handshake or from dbd_connect() */
+	  conn_data->encoding = strdup(dbd_encoding_to_iana(mysql_character_set_name(&conn_data->mysql)));
 	}
 
-	return iana_enc;
+	return conn_data->encoding;
 }
 
 const char* dbd_encoding_to_iana(const char *db_encoding) {
@@ -400,21 +425,26 @@ const char* dbd_encoding_from_iana(const char *iana_encoding) {
 }
 
 char *dbd_get_engine_version(dbi_conn_t *conn, char *versionstring) {
-  dbi_result_t *dbi_result;
   const char *versioninfo = NULL;
 
   /* initialize return string */
   *versionstring = '\0';
 
-  dbi_result = dbd_query(conn, "SELECT VERSION()");
+  /* the same as SELECT VERSION(), but the client library got it
+     with the handshake */
+  if (conn->connection) {
+    versioninfo = mysql_get_server_info((MYSQL *)conn->connection);
+  }
 
-  if (dbi_result) {
-    if (dbi_result_next_row(dbi_result)) {
-      versioninfo = dbi_result_get_string_idx(dbi_result, 1);
-      strncpy(versionstring, versioninfo, VERSIONSTRING_LENGTH-1);
-      versionstring[VERSIONSTRING_LENGTH-1] = '\0';
-    }
-    dbi_result_free(dbi_result);
+  /* MariaDB 10 sends "5.5.5-10.x.y-MariaDB" to keep old replication
+     clients happy, whereas SELECT VERSION() returns "10.x.y-MariaDB" */
+  if (versioninfo && !strncmp(versioninfo, "5.5.5-", 6)) {
+    versioninfo += 6;
+  }
+
+  if (versioninfo) {
+    strncpy(versionstring, versioninfo, VERSIONSTRING_LENGTH-1);
+    versionstring[VERSIONSTRING_LENGTH-1] = '\0';
   }
 
   return versionstring;
@@ -459,42 +489,75 @@ dbi_result_t *dbd_list_tables(dbi_conn_t *conn, const char *db, const char *patt
 
 size_t dbd_quote_string(dbi_driver_t *driver, const char *orig, char *dest) {
 	/* foo's -> 'foo\'s' */
-	unsigned long len;
+	size_t len;
 	
-	strcpy(dest, "'");
-	len = mysql_escape_string(dest+1, orig, strlen(orig));	
-	strcat(dest, "'");
+	dest[0] = '\'';
+	len = _escape_string(orig, strlen(orig), dest+1);
+	dest[len+1] = '\'';
+	dest[len+2] = '\0';
 	
-	return (size_t)(len+2);
+	return len+2;
 }
 
 size_t dbd_conn_quote_string(dbi_conn_t *conn, const char *orig, char *dest) {
 	/* foo's -> 'foo\'s' */
-	unsigned long len;
+	size_t len;
 	MYSQL *mycon = (MYSQL*)conn->connection;
 	
-	strcpy(dest, "'");
-	len = mysql_real_escape_string(mycon, dest+1, orig, strlen(orig));	
-	strcat(dest, "'");
+	dest[0] = '\'';
+	if (_needs_real_escape(mycon)) {
+		len = _real_escape_string(mycon, dest+1, orig, strlen(orig));
+		if (len == (unsigned long)-1) {
+			return DBI_LENGTH_ERROR;
+		}
+	}
+	else {
+		len = _escape_string(orig, strlen(orig), dest+1);
+	}
+	dest[len+1] = '\'';
+	dest[len+2] = '\0';
 	
-	return (size_t)(len+2);
+	return len+2;
 }
 
 size_t dbd_quote_binary(dbi_conn_t *conn, const unsigned char* orig, size_t from_length, unsigned char **ptr_dest) {
   unsigned char *temp;
   unsigned long len;
   MYSQL *mycon = (MYSQL*)conn->connection;
+  int hex_size = dbi_conn_get_option_numeric(conn, "mysql_quote_binary_hex");
+  int hex = (hex_size > 0 && from_length >= (size_t)hex_size);
 
   /* we allocate what mysql_real_escape_string needs, plus an extra two escape chars and a terminating zero*/
-  temp = malloc(2*from_length+1+2);
+  /* hex literals need the same plus the X */
+  temp = malloc(2*from_length+1+2+hex);
 
   if (!temp) {
     return DBI_LENGTH_ERROR;
   }
 
-  strcpy((char *)temp, "'");
-  len = mysql_real_escape_string(mycon, (char *)(temp+1), (const char *)orig, from_length);
-  strcpy((char *)(temp+len+1), "\'");
+  if (hex) {
+    temp[0] = 'X';
+    temp[1] = '\'';
+    len = mysql_hex_string((char *)(temp+2), (const char *)orig, from_length);
+    temp[len+2] = '\'';
+    temp[len+3] = '\0';
+    *ptr_dest = temp;
+    return (size_t)len+3;
+  }
+
+  temp[0] = '\'';
+  if (_needs_real_escape(mycon)) {
+    len = _real_escape_string(mycon, (char *)(temp+1), (const char *)orig, from_length);
+    if (len == (unsigned long)-1) {
+      free(temp);
+      return DBI_LENGTH_ERROR;
+    }
+  }
+  else {
+    len = _escape_string((const char *)orig, from_length, (char *)(temp+1));
+  }
+  temp[len+1] = '\'';
+  temp[len+2] = '\0';
   *ptr_dest = temp;
   return (size_t)len+2;
 }
@@ -508,20 +571,14 @@ dbi_result_t *dbd_query(dbi_conn_t *conn, const char *statement) {
 	dbi_result_t *result;
 	MYSQL_RES *res;
 	
-	if (mysql_query((MYSQL *)conn->connection, statement)) {
+	if (_check_busy(conn) || mysql_query((MYSQL *)conn->connection, statement)) {
 		return NULL;
 	}
 	
 	res = mysql_store_result((MYSQL *)conn->connection);
 	
-	/* if res is null, the query was something that doesn't return rows (like an INSERT) */
-	result = _dbd_result_create(conn, (void *)res, (res ? mysql_num_rows(res) : 0), 
-								mysql_affected_rows((MYSQL *)conn->connection));
-
-	if (res) {
-	  _dbd_result_set_numfields(result, mysql_num_fields((MYSQL_RES *)result->result_handle));
-	  _get_field_info(result);
-	}
+	result = _create_result(conn, res);
+	_discard_results((MYSQL *)conn->connection);
 
 	return result;
 }
@@ -530,20 +587,14 @@ dbi_result_t *dbd_query_null(dbi_conn_t *conn, const unsigned char *statement, s
 	dbi_result_t *result;
 	MYSQL_RES *res;
 	
-	if (mysql_real_query((MYSQL *)conn->connection, (const char *)statement, st_length)) {
+	if (_check_busy(conn) || mysql_real_query((MYSQL *)conn->connection, (const char *)statement, st_length)) {
 		return NULL;
 	}
 	
 	res = mysql_store_result((MYSQL *)conn->connection);
 	
-	/* if res is null, the query was something that doesn't return rows (like an INSERT) */
-	result = _dbd_result_create(conn, (void *)res, (res ? mysql_num_rows(res) : 0), 
-								mysql_affected_rows((MYSQL *)conn->connection));
-
-	if (res) {
-	  _dbd_result_set_numfields(result, mysql_num_fields((MYSQL_RES *)result->result_handle));
-	  _get_field_info(result);
-	}
+	result = _create_result(conn, res);
+	_discard_results((MYSQL *)conn->connection);
 
 	return result;
 }
@@ -554,6 +605,14 @@ const char *dbd_select_db(dbi_conn_t *conn, const char *db) {
 		return "";
 	}
 
+	/* unqualified table names of the prepared statements refer to
+	   the previous database */
+	_free_stmts((mysql_conn_data_t *)conn->connection);
+
+	/* the database encoding may differ */
+	free(((mysql_conn_data_t *)conn->connection)->encoding);
+	((mysql_conn_data_t *)conn->connection)->encoding = NULL;
+
 	if (conn->current_db) {
 	  free(conn->current_db);
 	}
@@ -593,129 +652,1614 @@ int dbd_ping(dbi_conn_t *conn) {
 	return 0;
 }
 
-/* CORE MYSQL DATA FETCHING STUFF */
+long long dbd_mysql_stream_query(dbi_conn Conn, const char *statement, dbd_mysql_row_func callback, void *user_arg) {
+	/* runs a query and passes the rows to the callback one at a time as
+	 * they arrive from the server, instead of loading the whole result
+	 * into memory first. The result passed to the callback provides the
+	 * field names and types, but no rows. The connection cannot be used
+	 * for other queries until this function returns. With the
+	 * mysql_read_ahead option, a thread receives the rows while the
+	 * callback processes the previous ones.
+	 * returns the number of rows passed to the callback, or -1 on error */
+	dbi_conn_t *conn = Conn;
+	MYSQL *mycon = (MYSQL *)conn->connection;
+	mysql_conn_data_t *conn_data = (mysql_conn_data_t *)conn->connection;
+	dbi_result_t *result;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	long long n_rows = 0;
+	int stop = 0;
+#ifdef HAVE_PTHREAD_H
+	int read_ahead = dbi_conn_get_option_numeric(conn, "mysql_read_ahead");
+#endif
 
-void _translate_mysql_type(MYSQL_FIELD *field, unsigned short *type, unsigned int *attribs) {
-	unsigned int _type = 0;
-	unsigned int _attribs = 0;
+	if (_check_busy(conn)) {
+		return -1;
+	}
+	if (mysql_query(mycon, statement)) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return -1;
+	}
+	if ((res = mysql_use_result(mycon)) == NULL) {
+		/* an error, or a statement which doesn't return rows */
+		if (mysql_errno(mycon)) {
+			_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+			return -1;
+		}
+		return 0;
+	}
 
-	switch (field->type) {
-		case FIELD_TYPE_TINY:
-			_type = DBI_TYPE_INTEGER;
-			_attribs |= DBI_INTEGER_SIZE1;
-			break;
-		case FIELD_TYPE_YEAR:
-			_attribs |= DBI_INTEGER_UNSIGNED;
-		case FIELD_TYPE_SHORT:
-			_type = DBI_TYPE_INTEGER;
-			_attribs |= DBI_INTEGER_SIZE2;
-			break;
-		case FIELD_TYPE_INT24:
-			_type = DBI_TYPE_INTEGER;
-			_attribs |= DBI_INTEGER_SIZE3;
-			break;
-		case FIELD_TYPE_LONG:
-			_type = DBI_TYPE_INTEGER;
-			_attribs |= DBI_INTEGER_SIZE4;
-			break;
-#ifdef FIELD_TYPE_BIT
-		case FIELD_TYPE_BIT: // BIT field (MySQL 5.0.3 and up)
-			_attribs |= DBI_INTEGER_UNSIGNED;
-#endif
-		case FIELD_TYPE_LONGLONG:
-			_type = DBI_TYPE_INTEGER;
-			_attribs |= DBI_INTEGER_SIZE8;
-			break;
-			
-		case FIELD_TYPE_FLOAT:
-			_type = DBI_TYPE_DECIMAL;
-			_attribs |= DBI_DECIMAL_SIZE4;
-			break;
-		case FIELD_TYPE_DOUBLE:
-			_type = DBI_TYPE_DECIMAL;
-			_attribs |= DBI_DECIMAL_SIZE8;
-			break;
-			
-		case FIELD_TYPE_DATE: /* TODO parse n stuph to native DBI unixtime type. for now, string */
-			_type = DBI_TYPE_DATETIME;
-			_attribs |= DBI_DATETIME_DATE;
-			break;
-		case FIELD_TYPE_TIME:
-			_type = DBI_TYPE_DATETIME;
-			_attribs |= DBI_DATETIME_TIME;
-			break;
-		case FIELD_TYPE_DATETIME:
-		case FIELD_TYPE_TIMESTAMP:
-			_type = DBI_TYPE_DATETIME;
-			_attribs |= DBI_DATETIME_DATE | DBI_DATETIME_TIME;
-			break;
-			
-		case FIELD_TYPE_VAR_STRING:
-		case FIELD_TYPE_STRING:
-		case FIELD_TYPE_TINY_BLOB:
-		case FIELD_TYPE_MEDIUM_BLOB:
-		case FIELD_TYPE_LONG_BLOB:
-		case FIELD_TYPE_BLOB:
-		default:
-			// see MySQL reference manual 22.2.1 on detecting binary flavour
-			// http://dev.mysql.com/doc/refman/5.0/en/c-api-datatypes.html
-			if(field->charsetnr == 63){
-				_type = DBI_TYPE_BINARY;
-				break;
-			}
-#ifdef FIELD_TYPE_NEWDECIMAL
-		case FIELD_TYPE_NEWDECIMAL: // Precision math DECIMAL or NUMERIC field (MySQL 5.0.3 and up)
+	/* the row count is unknown until the end, so the result has none */
+	result = _dbd_result_create(conn, (void *)res, 0, 0);
+	_dbd_result_set_numfields(result, mysql_num_fields(res));
+	_get_field_info(result);
+
+	conn_data->busy = 1;
+#ifdef HAVE_PTHREAD_H
+	if (read_ahead > 0) {
+		/* falls back to reading the rows here if the thread can't
+		   be started */
+		n_rows = _stream_read_ahead(result, callback, user_arg, (unsigned int)read_ahead, &stop);
+	}
+	if (n_rows == -1) {
+		n_rows = 0;
+		read_ahead = 0;
+	}
+	if (read_ahead <= 0)
 #endif
-		case FIELD_TYPE_DECIMAL: /* decimal is actually a string, has arbitrary precision, no floating point rounding */
-		case FIELD_TYPE_ENUM:
-		case FIELD_TYPE_SET:
-			_type = DBI_TYPE_STRING;
-			break;
+	while (!stop && (row = mysql_fetch_row(res)) != NULL) {
+		n_rows++;
+		stop = callback((dbi_result)result, (const char **)row, mysql_fetch_lengths(res), user_arg);
 	}
-	
-	*type = _type;
-	*attribs = _attribs;
+	conn_data->busy = 0;
+
+	if (n_rows == -2) {
+		/* the read-ahead thread ran out of memory */
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		n_rows = -1;
+	}
+	else if (!stop && mysql_errno(mycon)) {
+		/* mysql_fetch_row() failed, e.g. the connection was lost */
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		n_rows = -1;
+	}
+
+	/* this frees res, which discards the remaining rows if the
+	   callback stopped early */
+	dbi_result_free((dbi_result)result);
+	return n_rows;
 }
 
-void _get_field_info(dbi_result_t *result) {
-	unsigned int idx = 0;
-	MYSQL_FIELD *field;
-	unsigned short fieldtype;
-	unsigned int fieldattribs;
+dbi_result dbd_mysql_execute_params(dbi_conn Conn, const char *statement, unsigned int n_params, const char * const *param_values) {
+	/* runs a statement with the parameters n_params given as strings,
+	 * NULL pointers are sent as SQL NULL. The statement uses the binary
+	 * protocol and is prepared once, later calls with the same statement
+	 * text reuse it. All rows are fetched right away.
+	 * returns a result or NULL on error */
+	dbi_conn_t *conn = Conn;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND *params = NULL;
+	unsigned long *param_lengths = NULL;
+	MYSQL_RES *meta;
+	dbi_result_t *result;
+	unsigned int idx;
+	int failed;
 
-	field = mysql_fetch_fields((MYSQL_RES *)result->result_handle);
-	
-	while (idx < result->numfields) {
-		_translate_mysql_type(&field[idx], &fieldtype, &fieldattribs);
-		if ((fieldtype == DBI_TYPE_INTEGER) && (field[idx].flags & UNSIGNED_FLAG)) 
-			fieldattribs |= DBI_INTEGER_UNSIGNED;
-		_dbd_result_add_field(result, idx, field[idx].name, fieldtype, fieldattribs);
-		idx++;
+	if (_check_busy(conn) || (stmt = _get_stmt(conn, statement)) == NULL) {
+		return NULL;
+	}
+
+	if (mysql_stmt_param_count(stmt) != n_params) {
+		_dbd_internal_error_handler(conn, "wrong number of statement parameters", DBI_ERROR_CLIENT);
+		return NULL;
+	}
+
+	if (n_params) {
+		params = calloc(n_params, sizeof(MYSQL_BIND));
+		param_lengths = malloc(n_params * sizeof(unsigned long));
+		if (!params || !param_lengths) {
+			free(params);
+			free(param_lengths);
+			_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+			return NULL;
+		}
+		for (idx = 0; idx < n_params; idx++) {
+			if (param_values[idx]) {
+				params[idx].buffer_type = MYSQL_TYPE_STRING;
+				params[idx].buffer = (char *)param_values[idx];
+				params[idx].buffer_length = param_lengths[idx] = strlen(param_values[idx]);
+				params[idx].length = &param_lengths[idx];
+			}
+			else {
+				params[idx].buffer_type = MYSQL_TYPE_NULL;
+			}
+		}
+	}
+
+	failed = (n_params && mysql_stmt_bind_param(stmt, params)) || mysql_stmt_execute(stmt);
+	free(params);
+	free(param_lengths);
+	if (failed) {
+		_dbd_internal_error_handler(conn, mysql_stmt_error(stmt), DBI_ERROR_CLIENT);
+		_drop_stmt((mysql_conn_data_t *)conn->connection, stmt);
+		return NULL;
+	}
+
+	if ((meta = mysql_stmt_result_metadata(stmt)) == NULL) {
+		/* a statement which doesn't return rows (like an INSERT) */
+		return (dbi_result)_dbd_result_create(conn, NULL, 0, mysql_stmt_affected_rows(stmt));
+	}
+
+	/* libdbi needs the number of rows in advance */
+	if (mysql_stmt_store_result(stmt)) {
+		_dbd_internal_error_handler(conn, mysql_stmt_error(stmt), DBI_ERROR_CLIENT);
+		mysql_free_result(meta);
+		return NULL;
+	}
+
+	result = _dbd_result_create(conn, NULL, mysql_stmt_num_rows(stmt), mysql_stmt_affected_rows(stmt));
+	_dbd_result_set_numfields(result, mysql_num_fields(meta));
+	result->result_handle = (void *)meta;
+	_get_field_info(result);
+	result->result_handle = NULL;
+
+	if (_fetch_stmt_rows(result, stmt, mysql_fetch_fields(meta))) {
+		_dbd_internal_error_handler(conn, mysql_stmt_error(stmt), DBI_ERROR_CLIENT);
+		dbi_result_free((dbi_result)result);
+		result = NULL;
 	}
+
+	mysql_free_result(meta);
+	mysql_stmt_free_result(stmt);
+	return (dbi_result)result;
 }
 
-void _get_row_data(dbi_result_t *result, dbi_row_t *row, unsigned long long rowidx) {
-	MYSQL_RES *_res = result->result_handle;
-	MYSQL_ROW _row;
-	
-	unsigned int curfield = 0;
-	char *raw = NULL;
-	size_t *strsizes = NULL;
-	unsigned int sizeattrib;
-	dbi_data_t *data;	
+int dbd_mysql_get_stmt_stats(dbi_conn Conn, unsigned long *hits, unsigned long *misses, unsigned int *n_cached) {
+	/* reports how often dbd_mysql_execute_params() found the statement
+	 * in the cache of prepared statements, how often it had to prepare
+	 * it, and how many statements are cached right now.
+	 * returns 0 */
+	dbi_conn_t *conn = Conn;
+	mysql_conn_data_t *conn_data = (mysql_conn_data_t *)conn->connection;
+
+	if (hits) *hits = conn_data->stmt_hits;
+	if (misses) *misses = conn_data->stmt_misses;
+	if (n_cached) *n_cached = conn_data->n_stmts;
+	return 0;
+}
 
-	_row = mysql_fetch_row(_res);
-	strsizes = (size_t *)mysql_fetch_lengths(_res);
+int dbd_mysql_batch_query(dbi_conn Conn, const char **statements, size_t n_statements, dbi_result *results, size_t *failed_idx) {
+	/* sends all statements in a single round trip as a multi-statement
+	 * query and collects one result per statement. results must provide
+	 * room for n_statements results. A CALL yields the first result set
+	 * of the procedure, or its status if it returns none. The first
+	 * failing statement aborts the remainder of the batch; its index is
+	 * stored in failed_idx (n_statements if all succeeded).
+	 * returns 0 on success, -1 on error */
+	dbi_conn_t *conn = Conn;
+	MYSQL *mycon = (MYSQL *)conn->connection;
+	MYSQL_RES *res;
+	char *sql_cmd;
+	char *dest;
+	size_t len = 0;
+	size_t idx;
+	int multi = (dbi_conn_get_option_numeric(conn, "mysql_client_multi_statements") > 0);
+	int status;
+	int retval = 0;
+
+	if (failed_idx) *failed_idx = n_statements;
+	for (idx = 0; idx < n_statements; idx++) {
+		results[idx] = NULL;
+		len += strlen(statements[idx]) + 1;
+	}
+	if (!n_statements || _check_busy(conn)) {
+		return n_statements ? -1 : 0;
+	}
 
-	while (curfield < result->numfields) {
-		raw = _row[curfield];
-		data = &row->field_values[curfield];
-		
-		row->field_sizes[curfield] = 0;
-		/* this will be set to the string size later on if the field is indeed a string */
+	if ((sql_cmd = malloc(len)) == NULL) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		return -1;
+	}
+	for (idx = 0, dest = sql_cmd; idx < n_statements; idx++) {
+		if (idx) {
+			*dest++ = ';';
+		}
+		len = strlen(statements[idx]);
+		memcpy(dest, statements[idx], len);
+		dest += len;
+	}
 
-		if ((strsizes[curfield] == 0) && (raw == NULL)) {
-		        _set_field_flag( row, curfield, DBI_VALUE_NULL, 1);
+	/* enable multi-statement queries just for this batch unless the
+	   connection was opened with them */
+	if (!multi && mysql_set_server_option(mycon, MYSQL_OPTION_MULTI_STATEMENTS_ON)) {
+		free(sql_cmd);
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return -1;
+	}
+
+	status = mysql_real_query(mycon, sql_cmd, (unsigned long)(dest - sql_cmd));
+	free(sql_cmd);
+
+	idx = 0;
+	if (!status) {
+		do {
+			/* statements without rows have no result set */
+			res = mysql_store_result(mycon);
+			if (!res && mysql_field_count(mycon)) {
+				status = 1;
+				break;
+			}
+			if (idx < n_statements && !results[idx]) {
+				results[idx] = (dbi_result)_create_result(conn, res);
+			}
+			else {
+				/* further result sets of a CALL */
+				mysql_free_result(res);
+			}
+			/* a CALL returns the result sets of the procedure,
+			   followed by a status without a result set. Other
+			   statements return a single result */
+			if (!res || idx >= n_statements || !_is_call(statements[idx])) {
+				idx++;
+			}
+		} while ((status = mysql_next_result(mycon)) == 0);
+	}
+
+	if (status > 0) {
+		if (failed_idx) *failed_idx = idx;
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		retval = -1;
+	}
+
+	if (!multi) {
+		mysql_set_server_option(mycon, MYSQL_OPTION_MULTI_STATEMENTS_OFF);
+	}
+	return retval;
+}
+
+long long dbd_mysql_load_data(dbi_conn Conn, const char *table, const char *columns, unsigned int n_fields, dbd_mysql_load_func next_row, void *user_arg) {
+	/* loads the rows provided by next_row into the table using LOAD DATA
+	 * LOCAL INFILE, without a temporary file. columns lists the n_fields
+	 * columns in parentheses, or is NULL to fill all columns in table
+	 * order. Requires the mysql_client_local_files option.
+	 * returns the number of rows loaded, or -1 on error */
+	dbi_conn_t *conn = Conn;
+	MYSQL *mycon = (MYSQL *)conn->connection;
+	mysql_infile_t infile;
+	char *sql_cmd;
+	int failed;
+
+	if (_check_busy(conn)) {
+		return -1;
+	}
+	if (dbi_conn_get_option_numeric(conn, "mysql_client_local_files") <= 0) {
+		_dbd_internal_error_handler(conn, "LOAD DATA LOCAL requires the mysql_client_local_files option", DBI_ERROR_CLIENT);
+		return -1;
+	}
+	if (!n_fields) {
+		_dbd_internal_error_handler(conn, "LOAD DATA LOCAL needs at least one field", DBI_ERROR_CLIENT);
+		return -1;
+	}
+
+	memset(&infile, 0, sizeof(infile));
+	infile.next_row = next_row;
+	infile.user_arg = user_arg;
+	infile.n_fields = n_fields;
+	infile.values = calloc(n_fields, sizeof(char *));
+	infile.lengths = calloc(n_fields, sizeof(size_t));
+
+	/* the data is sent in the connection character set, tab-separated
+	   with the default escaping of LOAD DATA */
+	asprintf(&sql_cmd, "LOAD DATA LOCAL INFILE 'dbd_mysql' INTO TABLE %s CHARACTER SET %s FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\' LINES TERMINATED BY '\\n' %s",
+		 table, mysql_character_set_name(mycon), columns ? columns : "");
+
+	if (!infile.values || !infile.lengths || !sql_cmd) {
+		free(infile.values);
+		free(infile.lengths);
+		free(sql_cmd);
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		return -1;
+	}
+
+	mysql_set_local_infile_handler(mycon, _infile_init, _infile_read, _infile_end, _infile_error, &infile);
+	failed = mysql_query(mycon, sql_cmd);
+	mysql_set_local_infile_default(mycon);
+
+	free(sql_cmd);
+	free(infile.values);
+	free(infile.lengths);
+	free(infile.buf);
+
+	if (failed) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return -1;
+	}
+	return (long long)mysql_affected_rows(mycon);
+}
+
+int dbd_mysql_send_query(dbi_conn Conn, const char *statement) {
+	/* starts a query without waiting for the server. If the function
+	 * returns a wait status, wait until the socket returned by
+	 * dbi_conn_get_socket() is ready as requested, or for the time
+	 * returned by dbd_mysql_get_timeout(), then call dbd_mysql_continue().
+	 * Once 0 is returned, retrieve the result with dbd_mysql_get_result().
+	 * Without the non-blocking API of MariaDB Connector/C, the query
+	 * runs to completion right away.
+	 * returns 0 if the result is available, a MYSQL_WAIT_* bitmask to
+	 * wait for, or -1 on error */
+	dbi_conn_t *conn = Conn;
+	MYSQL *mycon = (MYSQL *)conn->connection;
+	mysql_conn_data_t *conn_data = (mysql_conn_data_t *)conn->connection;
+	int err;
+	int status;
+
+	if (_check_busy(conn)) {
+		return -1;
+	}
+
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+	/* the non-blocking API allocates a stack for each connection, so
+	   enable it only for connections which use it. This does not
+	   affect the blocking functions */
+	if (!conn_data->nonblock) {
+		if (mysql_options(mycon, MYSQL_OPT_NONBLOCK, 0)) {
+			_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+			return -1;
+		}
+		conn_data->nonblock = 1;
+	}
+#endif
+
+	conn_data->busy = 1;
+	conn_data->async_state = MYSQL_ASYNC_QUERY;
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+	status = mysql_real_query_start(&err, mycon, statement, strlen(statement));
+#else
+	err = mysql_real_query(mycon, statement, strlen(statement));
+	status = 0;
+#endif
+	return _async_step(conn, status, err, NULL);
+}
+
+int dbd_mysql_continue(dbi_conn Conn, int ready_status) {
+	/* continues the query started by dbd_mysql_send_query(). ready_status
+	 * tells which of the conditions requested by the previous call are
+	 * met, as a MYSQL_WAIT_* bitmask.
+	 * returns 0 if the result is available, a MYSQL_WAIT_* bitmask to
+	 * wait for, or -1 on error */
+	dbi_conn_t *conn = Conn;
+	mysql_conn_data_t *conn_data = (mysql_conn_data_t *)conn->connection;
+	int err = 0;
+	MYSQL_RES *res = NULL;
+	int status = 0;
+
+	switch (conn_data->async_state) {
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+		case MYSQL_ASYNC_QUERY:
+			status = mysql_real_query_cont(&err, &conn_data->mysql, ready_status);
+			break;
+		case MYSQL_ASYNC_STORE:
+			status = mysql_store_result_cont(&res, &conn_data->mysql, ready_status);
+			break;
+#endif
+		case MYSQL_ASYNC_DONE:
+			return 0;
+		default:
+			_dbd_internal_error_handler(conn, "no query in progress", DBI_ERROR_CLIENT);
+			return -1;
+	}
+	return _async_step(conn, status, err, res);
+}
+
+dbi_result dbd_mysql_get_result(dbi_conn Conn) {
+	/* returns the result of the query started by dbd_mysql_send_query()
+	 * once dbd_mysql_send_query() or dbd_mysql_continue() returned 0.
+	 * returns a result or NULL on error */
+	dbi_conn_t *conn = Conn;
+	mysql_conn_data_t *conn_data = (mysql_conn_data_t *)conn->connection;
+	dbi_result_t *result;
+
+	if (conn_data->async_state != MYSQL_ASYNC_DONE) {
+		_dbd_internal_error_handler(conn, "the query has not finished", DBI_ERROR_CLIENT);
+		return NULL;
+	}
+
+	conn_data->async_state = MYSQL_ASYNC_IDLE;
+	conn_data->busy = 0;
+	result = _create_result(conn, conn_data->async_res);
+	conn_data->async_res = NULL;
+	_discard_results(&conn_data->mysql);
+	return (dbi_result)result;
+}
+
+unsigned int dbd_mysql_get_timeout(dbi_conn Conn) {
+	/* returns the time in milliseconds after which dbd_mysql_continue()
+	 * should be called with MYSQL_WAIT_TIMEOUT if the socket does not
+	 * become ready earlier. Only meaningful if the last wait status
+	 * included MYSQL_WAIT_TIMEOUT */
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+	dbi_conn_t *conn = Conn;
+
+	return mysql_get_timeout_value_ms((MYSQL *)conn->connection);
+#else
+	return 0;
+#endif
+}
+
+int _async_step(dbi_conn_t *conn, int status, int err, MYSQL_RES *res) {
+	/* advances the state of an asynchronous query after a call to the
+	   client library. status is the wait status returned by that call,
+	   err the query error, and res the stored result.
+	   returns the wait status, 0 if done, -1 on error */
+	mysql_conn_data_t *conn_data = (mysql_conn_data_t *)conn->connection;
+
+	if (status) {
+		/* the library needs to wait for the socket */
+		return status;
+	}
+
+	if (conn_data->async_state == MYSQL_ASYNC_QUERY) {
+		if (err) {
+			conn_data->async_state = MYSQL_ASYNC_IDLE;
+			conn_data->busy = 0;
+			_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+			return -1;
+		}
+		/* the query went through, now receive the result */
+		conn_data->async_state = MYSQL_ASYNC_STORE;
+#ifdef HAVE_MYSQL_REAL_QUERY_START
+		if ((status = mysql_store_result_start(&res, &conn_data->mysql)) != 0) {
+			return status;
+		}
+#else
+		res = mysql_store_result(&conn_data->mysql);
+#endif
+	}
+
+	/* the result is complete. If there is none although the statement
+	   returns rows, something went wrong */
+	if (!res && mysql_field_count(&conn_data->mysql)) {
+		conn_data->async_state = MYSQL_ASYNC_IDLE;
+		conn_data->busy = 0;
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return -1;
+	}
+	conn_data->async_res = res;
+	conn_data->async_state = MYSQL_ASYNC_DONE;
+	return 0;
+}
+
+long long dbd_mysql_insert_rows(dbi_conn Conn, const char *table, const char *columns, unsigned int n_fields, dbd_mysql_load_func next_row, dbd_mysql_batch_func batch_done, void *user_arg, int transaction) {
+	/* inserts the rows provided by next_row into the table using
+	 * multi-row INSERT statements which are as large as the server's
+	 * max_allowed_packet permits. columns lists the n_fields columns in
+	 * parentheses, or is NULL to fill all columns in table order.
+	 * batch_done, if not NULL, is called after each statement. If
+	 * transaction is nonzero, all statements run in one transaction
+	 * which is rolled back on error. If the caller has a transaction
+	 * open already, a savepoint is used instead, so that only our
+	 * statements are undone.
+	 * returns the number of affected rows, or -1 on error */
+	dbi_conn_t *conn = Conn;
+	MYSQL *mycon = (MYSQL *)conn->connection;
+	const char **values = NULL;
+	size_t *lengths = NULL;
+	char *sql_cmd = NULL;		/* the statement being built */
+	size_t sql_len;
+	size_t sql_size;
+	size_t prefix_len;
+	char *tuple = NULL;		/* the current row */
+	size_t tuple_len;
+	size_t tuple_size = 0;
+	size_t needed;
+	size_t limit;
+	unsigned long long n_rows = 0;	/* rows in the current statement */
+	unsigned long long affected;
+	long long total = 0;
+	unsigned int idx;
+	char *dest;
+	unsigned long escaped;
+	int rc;
+	int failed = 0;
+	int savepoint = 0;
+
+	if (_check_busy(conn)) {
+		return -1;
+	}
+
+	/* leave some room for the packet header */
+	limit = _get_max_packet(conn) - 1024;
+
+	values = calloc(n_fields ? n_fields : 1, sizeof(char *));
+	lengths = calloc(n_fields ? n_fields : 1, sizeof(size_t));
+	sql_size = strlen(table) + (columns ? strlen(columns) : 0) + 64;
+	sql_cmd = malloc(sql_size);
+	if (!values || !lengths || !sql_cmd) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		failed = 1;
+		goto finish;
+	}
+	sql_len = prefix_len = snprintf(sql_cmd, sql_size, "INSERT INTO %s %s VALUES ", table, columns ? columns : "");
+
+	if (transaction) {
+		/* START TRANSACTION would commit an open transaction */
+		savepoint = (mycon->server_status & SERVER_STATUS_IN_TRANS) ? 1 : 0;
+		if (mysql_query(mycon, savepoint ? "SAVEPOINT dbd_mysql_insert_rows" : "START TRANSACTION")) {
+			_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+			transaction = 0;
+			failed = 1;
+			goto finish;
+		}
+	}
+
+	for (;;) {
+		for (idx = 0; idx < n_fields; idx++) {
+			values[idx] = NULL;
+			lengths[idx] = 0;
+		}
+		if ((rc = next_row(values, lengths, user_arg)) < 0) {
+			_dbd_internal_error_handler(conn, "the row callback failed", DBI_ERROR_CLIENT);
+			failed = 1;
+			break;
+		}
+
+		tuple_len = 0;
+		if (rc > 0) {
+			/* mysql_real_escape_string() needs up to twice the
+			   length, plus quotes and commas */
+			needed = n_fields + 3;
+			for (idx = 0; idx < n_fields; idx++) {
+				if (values[idx] && !lengths[idx]) {
+					lengths[idx] = strlen(values[idx]);
+				}
+				needed += values[idx] ? 2*lengths[idx] + 2 : 4;
+			}
+			if (needed > tuple_size) {
+				if ((dest = realloc(tuple, needed)) == NULL) {
+					_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+					failed = 1;
+					break;
+				}
+				tuple = dest;
+				tuple_size = needed;
+			}
+
+			dest = tuple;
+			*dest++ = '(';
+			for (idx = 0; idx < n_fields; idx++) {
+				if (idx) {
+					*dest++ = ',';
+				}
+				if (!values[idx]) {
+					memcpy(dest, "NULL", 4);
+					dest += 4;
+					continue;
+				}
+				*dest++ = '\'';
+				escaped = _real_escape_string(mycon, dest, values[idx], lengths[idx]);
+				if (escaped == (unsigned long)-1) {
+					break;
+				}
+				dest += escaped;
+				*dest++ = '\'';
+			}
+			if (idx < n_fields) {
+				_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+				failed = 1;
+				break;
+			}
+			*dest++ = ')';
+			tuple_len = dest - tuple;
+		}
+
+		/* send what we have if the row doesn't fit, or at the end */
+		if (n_rows && (rc == 0 || !_tuple_fits(sql_len, tuple_len, limit))) {
+			if (mysql_real_query(mycon, sql_cmd, sql_len)) {
+				_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+				failed = 1;
+				break;
+			}
+			affected = mysql_affected_rows(mycon);
+			total += affected;
+			if (batch_done) {
+				batch_done(n_rows, affected, user_arg);
+			}
+			sql_len = prefix_len;
+			n_rows = 0;
+		}
+		if (rc == 0) {
+			break;
+		}
+
+		if (_append_tuple(&sql_cmd, &sql_len, &sql_size, prefix_len, tuple, tuple_len)) {
+			_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+			failed = 1;
+			break;
+		}
+		n_rows++;
+	}
+
+	if (transaction && savepoint) {
+		if (failed) {
+			mysql_query(mycon, "ROLLBACK TO SAVEPOINT dbd_mysql_insert_rows");
+		}
+		else if (mysql_query(mycon, "RELEASE SAVEPOINT dbd_mysql_insert_rows")) {
+			_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+			failed = 1;
+		}
+	}
+	else if (transaction) {
+		if (failed) {
+			mysql_rollback(mycon);
+		}
+		else if (mysql_commit(mycon)) {
+			_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+			failed = 1;
+		}
+	}
+
+finish:
+	free(values);
+	free(lengths);
+	free(sql_cmd);
+	free(tuple);
+	return failed ? -1 : total;
+}
+
+int _tuple_fits(size_t sql_len, size_t tuple_len, size_t limit) {
+	/* returns 1 if a tuple can be added to a statement of sql_len
+	   bytes without exceeding limit, 0 if not */
+	return (sql_len + 1 + tuple_len <= limit) ? 1 : 0;
+}
+
+int _append_tuple(char **sql_cmd, size_t *sql_len, size_t *sql_size, size_t prefix_len, const char *tuple, size_t tuple_len) {
+	/* appends a tuple to the INSERT statement in sql_cmd, separated by
+	   a comma unless it is the first one after the prefix_len bytes of
+	   INSERT INTO ... VALUES. The buffer grows as needed and stays
+	   null-terminated. returns 0 on success, -1 if out of memory */
+	size_t needed = *sql_len + 1 + tuple_len + 1;
+	char *grown;
+
+	if (needed > *sql_size) {
+		if (needed < 2 * *sql_size) {
+			needed = 2 * *sql_size;
+		}
+		if ((grown = realloc(*sql_cmd, needed)) == NULL) {
+			return -1;
+		}
+		*sql_cmd = grown;
+		*sql_size = needed;
+	}
+	if (*sql_len > prefix_len) {
+		(*sql_cmd)[(*sql_len)++] = ',';
+	}
+	memcpy(*sql_cmd + *sql_len, tuple, tuple_len);
+	*sql_len += tuple_len;
+	(*sql_cmd)[*sql_len] = '\0';
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+long long _stream_read_ahead(dbi_result_t *result, dbd_mysql_row_func callback, void *user_arg, unsigned int depth, int *stop) {
+	/* passes the rows of a mysql_use_result() result to the callback
+	   while a thread reads up to depth rows ahead. stop is set as in
+	   dbd_mysql_stream_query(). Returns the number of rows, -1 if the
+	   thread could not be started, or -2 if it ran out of memory */
+	mysql_read_ahead_t ra;
+	mysql_read_ahead_row_t *row;
+	pthread_t thread;
+	long long n_rows = 0;
+	unsigned int idx;
+
+	memset(&ra, 0, sizeof(ra));
+	ra.res = result->result_handle;
+	ra.n_fields = result->numfields;
+	ra.depth = depth;
+	if ((ra.rows = calloc(depth, sizeof(mysql_read_ahead_row_t))) == NULL) {
+		return -1;
+	}
+	for (idx = 0; idx < depth; idx++) {
+		ra.rows[idx].values = calloc(ra.n_fields ? ra.n_fields : 1, sizeof(char *));
+		ra.rows[idx].lengths = calloc(ra.n_fields ? ra.n_fields : 1, sizeof(unsigned long));
+		if (!ra.rows[idx].values || !ra.rows[idx].lengths) {
+			n_rows = -1;
+			goto finish;
+		}
+	}
+
+	pthread_mutex_init(&ra.lock, NULL);
+	pthread_cond_init(&ra.not_empty, NULL);
+	pthread_cond_init(&ra.not_full, NULL);
+	if (pthread_create(&thread, NULL, _read_ahead_thread, &ra)) {
+		n_rows = -1;
+		goto destroy;
+	}
+
+	pthread_mutex_lock(&ra.lock);
+	while (!*stop) {
+		while (!ra.count && !ra.done) {
+			pthread_cond_wait(&ra.not_empty, &ra.lock);
+		}
+		if (!ra.count) {
+			break;
+		}
+		/* the thread doesn't touch queued rows, so the callback can
+		   run unlocked */
+		row = &ra.rows[ra.head];
+		pthread_mutex_unlock(&ra.lock);
+		n_rows++;
+		*stop = callback((dbi_result)result, row->values, row->lengths, user_arg);
+		pthread_mutex_lock(&ra.lock);
+		ra.head = (ra.head + 1) % ra.depth;
+		ra.count--;
+		pthread_cond_signal(&ra.not_full);
+	}
+	if (*stop) {
+		ra.stop = 1;
+		pthread_cond_signal(&ra.not_full);
+	}
+	else if (ra.nomem) {
+		n_rows = -2;
+	}
+	pthread_mutex_unlock(&ra.lock);
+	pthread_join(thread, NULL);
+
+destroy:
+	pthread_mutex_destroy(&ra.lock);
+	pthread_cond_destroy(&ra.not_empty);
+	pthread_cond_destroy(&ra.not_full);
+finish:
+	for (idx = 0; idx < depth; idx++) {
+		free(ra.rows[idx].values);
+		free(ra.rows[idx].lengths);
+		free(ra.rows[idx].buf);
+	}
+	free(ra.rows);
+	return n_rows;
+}
+
+void *_read_ahead_thread(void *arg) {
+	/* the read-ahead thread of _stream_read_ahead(). Only this thread
+	   uses the connection until it finishes */
+	mysql_read_ahead_t *ra = arg;
+	mysql_read_ahead_row_t *row;
+	MYSQL_ROW mysql_row;
+	unsigned long *lengths;
+	size_t size;
+	char *buf;
+	unsigned int idx;
+
+	mysql_thread_init();
+	while ((mysql_row = mysql_fetch_row(ra->res)) != NULL) {
+		/* wait for a free slot, this holds back the reading if the
+		   callback is slower than the network */
+		pthread_mutex_lock(&ra->lock);
+		while (ra->count == ra->depth && !ra->stop) {
+			pthread_cond_wait(&ra->not_full, &ra->lock);
+		}
+		if (ra->stop) {
+			pthread_mutex_unlock(&ra->lock);
+			break;
+		}
+		row = &ra->rows[(ra->head + ra->count) % ra->depth];
+		pthread_mutex_unlock(&ra->lock);
+
+		/* mysql_fetch_row() reuses its buffer, so copy the values */
+		lengths = mysql_fetch_lengths(ra->res);
+		size = 0;
+		for (idx = 0; idx < ra->n_fields; idx++) {
+			size += lengths[idx] + 1;
+		}
+		if (size > row->buf_size) {
+			if ((buf = realloc(row->buf, size)) == NULL) {
+				pthread_mutex_lock(&ra->lock);
+				ra->nomem = 1;
+				pthread_mutex_unlock(&ra->lock);
+				break;
+			}
+			row->buf = buf;
+			row->buf_size = size;
+		}
+		buf = row->buf;
+		for (idx = 0; idx < ra->n_fields; idx++) {
+			row->lengths[idx] = lengths[idx];
+			if (!mysql_row[idx]) {
+				row->values[idx] = NULL;
+				continue;
+			}
+			memcpy(buf, mysql_row[idx], lengths[idx]);
+			buf[lengths[idx]] = '\0';
+			row->values[idx] = buf;
+			buf += lengths[idx] + 1;
+		}
+
+		pthread_mutex_lock(&ra->lock);
+		ra->count++;
+		pthread_cond_signal(&ra->not_empty);
+		pthread_mutex_unlock(&ra->lock);
+	}
+
+	pthread_mutex_lock(&ra->lock);
+	ra->done = 1;
+	pthread_cond_signal(&ra->not_empty);
+	pthread_mutex_unlock(&ra->lock);
+	mysql_thread_end();
+	return NULL;
+}
+#endif
+
+int _needs_real_escape(MYSQL *mycon) {
+	/* _escape_string() works byte by byte like mysql_escape_string(),
+	   which is fine for single-byte encodings and for those multibyte
+	   encodings which use only non-ASCII bytes in multibyte
+	   characters, like UTF-8. The others need the client library. The
+	   NO_BACKSLASH_ESCAPES SQL mode needs quotes doubled instead of
+	   escaped, which _real_escape_string() does itself */
+	static const char *unsafe_charsets[] = {"big5", "cp932", "gbk", "gb18030", "sjis", NULL};
+	const char *charset;
+	int i;
+
+	if (!mycon) {
+		return 0;
+	}
+#ifdef SERVER_STATUS_NO_BACKSLASH_ESCAPES
+	if (mycon->server_status & SERVER_STATUS_NO_BACKSLASH_ESCAPES) {
+		return 1;
+	}
+#endif
+	charset = mysql_character_set_name(mycon);
+	for (i = 0; charset && unsafe_charsets[i]; i++) {
+		if (!strcmp(charset, unsafe_charsets[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+size_t _escape_string(const char *src, size_t len, char *dest) {
+	/* escapes the same characters as mysql_escape_string(). Runs of
+	   characters which need no escaping are copied in one go. dest
+	   must have room for 2*len+1 bytes. Returns the length of the
+	   escaped string */
+	static const char escapes[256] = {
+		['\0'] = '0', ['\n'] = 'n', ['\r'] = 'r', ['\\'] = '\\',
+		['\''] = '\'', ['"'] = '"', ['\032'] = 'Z'
+	};
+	char *out = dest;
+	size_t start = 0;
+	size_t i = 0;
+
+	while (i < len) {
+#ifdef __SSE2__
+		/* skip 16 bytes at a time as long as none is special */
+		for (; i + 16 <= len; i += 16) {
+			__m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+			__m128i hit = _mm_or_si128(
+				_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(in, _mm_setzero_si128()),
+							  _mm_cmpeq_epi8(in, _mm_set1_epi8('\n'))),
+					     _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('\r')),
+							  _mm_cmpeq_epi8(in, _mm_set1_epi8('\\')))),
+				_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('\'')),
+							  _mm_cmpeq_epi8(in, _mm_set1_epi8('"'))),
+					     _mm_cmpeq_epi8(in, _mm_set1_epi8('\032'))));
+			if (_mm_movemask_epi8(hit)) {
+				break;
+			}
+		}
+#endif
+		/* find the special character, if any */
+		while (i < len && !escapes[(unsigned char)src[i]]) {
+			i++;
+		}
+		memcpy(out, src + start, i - start);
+		out += i - start;
+		if (i < len) {
+			*out++ = '\\';
+			*out++ = escapes[(unsigned char)src[i]];
+			i++;
+		}
+		start = i;
+	}
+	*out = '\0';
+	return out - dest;
+}
+
+int _check_busy(dbi_conn_t *conn) {
+	/* a streamed result must be read to the end before the connection
+	   accepts another command. returns 1 if the connection is busy */
+	if (conn->connection && ((mysql_conn_data_t *)conn->connection)->busy) {
+		_dbd_internal_error_handler(conn, "connection is busy with another query", DBI_ERROR_CLIENT);
+		return 1;
+	}
+	return 0;
+}
+
+MYSQL_STMT *_get_stmt(dbi_conn_t *conn, const char *statement) {
+	/* returns the prepared statement for the statement text, preparing
+	   it if it is not in the cache. The cache holds up to
+	   mysql_stmt_cache_size statements, the least recently used one is
+	   closed to make room for a new one.
+	   returns the statement, or NULL on error */
+	mysql_conn_data_t *conn_data = (mysql_conn_data_t *)conn->connection;
+	mysql_stmt_entry_t **link;
+	mysql_stmt_entry_t *entry;
+	MYSQL_STMT *stmt;
+	int capacity = dbi_conn_get_option_numeric(conn, "mysql_stmt_cache_size");
+
+	if (capacity <= 0) {
+		capacity = MYSQL_STMT_CACHE_SIZE;
+	}
+
+	for (link = &conn_data->stmts; (entry = *link) != NULL; link = &entry->next) {
+		if (!strcmp(entry->statement, statement)) {
+			/* move it to the front */
+			*link = entry->next;
+			entry->next = conn_data->stmts;
+			conn_data->stmts = entry;
+			conn_data->stmt_hits++;
+			return entry->stmt;
+		}
+	}
+	conn_data->stmt_misses++;
+
+	if ((stmt = mysql_stmt_init(&conn_data->mysql)) == NULL) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		return NULL;
+	}
+	if (mysql_stmt_prepare(stmt, statement, strlen(statement))) {
+		_dbd_internal_error_handler(conn, mysql_stmt_error(stmt), DBI_ERROR_CLIENT);
+		mysql_stmt_close(stmt);
+		return NULL;
+	}
+
+	if ((entry = calloc(1, sizeof(mysql_stmt_entry_t))) == NULL
+	    || (entry->statement = strdup(statement)) == NULL) {
+		free(entry);
+		mysql_stmt_close(stmt);
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		return NULL;
+	}
+	entry->stmt = stmt;
+	entry->next = conn_data->stmts;
+	conn_data->stmts = entry;
+	conn_data->n_stmts++;
+
+	while (conn_data->n_stmts > (unsigned int)capacity) {
+		for (link = &conn_data->stmts; (*link)->next; link = &(*link)->next);
+		entry = *link;
+		*link = NULL;
+		mysql_stmt_close(entry->stmt);
+		free(entry->statement);
+		free(entry);
+		conn_data->n_stmts--;
+	}
+	return stmt;
+}
+
+void _drop_stmt(mysql_conn_data_t *conn_data, MYSQL_STMT *stmt) {
+	/* removes a statement from the cache, e.g. after it failed */
+	mysql_stmt_entry_t **link;
+	mysql_stmt_entry_t *entry;
+
+	for (link = &conn_data->stmts; (entry = *link) != NULL; link = &entry->next) {
+		if (entry->stmt == stmt) {
+			*link = entry->next;
+			mysql_stmt_close(entry->stmt);
+			free(entry->statement);
+			free(entry);
+			conn_data->n_stmts--;
+			return;
+		}
+	}
+}
+
+void _free_stmts(mysql_conn_data_t *conn_data) {
+	mysql_stmt_entry_t *entry;
+
+	while ((entry = conn_data->stmts) != NULL) {
+		conn_data->stmts = entry->next;
+		mysql_stmt_close(entry->stmt);
+		free(entry->statement);
+		free(entry);
+	}
+	conn_data->n_stmts = 0;
+}
+
+int _fetch_stmt_rows(dbi_result_t *result, MYSQL_STMT *stmt, MYSQL_FIELD *fields) {
+	/* fetches all rows of an executed statement into the result. Numbers
+	   are written by libmysqlclient straight into the row data.
+	   returns 0 on success, -1 on error */
+	MYSQL_BIND *binds;
+	MYSQL_BIND column;
+	unsigned long *lengths;
+	my_bool *nulls;
+	char *temp;			/* 32 bytes per field for dates and bits */
+	dbi_row_t *row;
+	dbi_data_t *data;
+	unsigned long long rowidx;
+	unsigned int idx;
+	unsigned int sizeattrib;
+	unsigned long len;
+	int include_null = (dbi_conn_get_option_numeric(result->conn, "mysql_include_trailing_null") == 1);
+	int rc;
+	int retval = 0;
+
+	binds = calloc(result->numfields, sizeof(MYSQL_BIND));
+	lengths = calloc(result->numfields, sizeof(unsigned long));
+	nulls = calloc(result->numfields, sizeof(my_bool));
+	temp = malloc(result->numfields * 32);
+	if (!binds || !lengths || !nulls || !temp) {
+		retval = -1;
+		goto finish;
+	}
+
+	for (rowidx = 0; rowidx < result->numrows_matched; rowidx++) {
+		/* hand the row to libdbi right away, so it is freed along
+		   with the result if something goes wrong */
+		row = _dbd_row_allocate(result->numfields);
+		_dbd_row_finalize(result, row, rowidx);
+
+		for (idx = 0; idx < result->numfields; idx++) {
+			data = &row->field_values[idx];
+			memset(&binds[idx], 0, sizeof(MYSQL_BIND));
+			binds[idx].length = &lengths[idx];
+			binds[idx].is_null = &nulls[idx];
+
+			switch (result->field_types[idx]) {
+				case DBI_TYPE_INTEGER:
+					binds[idx].is_unsigned = (result->field_attribs[idx] & DBI_INTEGER_UNSIGNED) ? 1 : 0;
+					if (fields[idx].type == FIELD_TYPE_BIT) {
+						/* sent as a string of bytes */
+						binds[idx].buffer_type = MYSQL_TYPE_BLOB;
+						binds[idx].buffer = temp + idx*32;
+						binds[idx].buffer_length = 32;
+						break;
+					}
+					if (_is_decimal_field(&fields[idx])) {
+						/* mysql_decimal_as_int, scaled below */
+						binds[idx].buffer_type = MYSQL_TYPE_STRING;
+						binds[idx].buffer = temp + idx*32;
+						binds[idx].buffer_length = 32;
+						break;
+					}
+					switch (result->field_attribs[idx] & DBI_INTEGER_SIZEMASK) {
+						case DBI_INTEGER_SIZE1:
+							binds[idx].buffer_type = MYSQL_TYPE_TINY;
+							binds[idx].buffer = &data->d_char;
+							break;
+						case DBI_INTEGER_SIZE2:
+							binds[idx].buffer_type = MYSQL_TYPE_SHORT;
+							binds[idx].buffer = &data->d_short;
+							break;
+						case DBI_INTEGER_SIZE3:
+						case DBI_INTEGER_SIZE4:
+							binds[idx].buffer_type = MYSQL_TYPE_LONG;
+							binds[idx].buffer = &data->d_long;
+							break;
+						case DBI_INTEGER_SIZE8:
+						default:
+							binds[idx].buffer_type = MYSQL_TYPE_LONGLONG;
+							binds[idx].buffer = &data->d_longlong;
+							break;
+					}
+					break;
+				case DBI_TYPE_DECIMAL:
+					if ((result->field_attribs[idx] & DBI_DECIMAL_SIZEMASK) == DBI_DECIMAL_SIZE4) {
+						binds[idx].buffer_type = MYSQL_TYPE_FLOAT;
+						binds[idx].buffer = &data->d_float;
+					}
+					else {
+						binds[idx].buffer_type = MYSQL_TYPE_DOUBLE;
+						binds[idx].buffer = &data->d_double;
+					}
+					break;
+				case DBI_TYPE_DATETIME:
+					binds[idx].buffer_type = MYSQL_TYPE_STRING;
+					binds[idx].buffer = temp + idx*32;
+					binds[idx].buffer_length = 32;
+					break;
+				default:
+					/* only ask for the length, see below */
+					binds[idx].buffer_type = (result->field_types[idx] == DBI_TYPE_BINARY) ? MYSQL_TYPE_BLOB : MYSQL_TYPE_STRING;
+					break;
+			}
+		}
+
+		if (mysql_stmt_bind_result(stmt, binds)) {
+			retval = -1;
+			goto finish;
+		}
+		rc = mysql_stmt_fetch(stmt);
+		if (rc != 0 && rc != MYSQL_DATA_TRUNCATED) {
+			retval = -1;
+			goto finish;
+		}
+
+		for (idx = 0; idx < result->numfields; idx++) {
+			data = &row->field_values[idx];
+			len = lengths[idx];
+
+			if (nulls[idx]) {
+				_set_field_flag(row, idx, DBI_VALUE_NULL, 1);
+				continue;
+			}
+
+			switch (result->field_types[idx]) {
+				case DBI_TYPE_INTEGER:
+					if (fields[idx].type == FIELD_TYPE_BIT) {
+						unsigned long byte;
+						data->d_longlong = 0;
+						for (byte = 0; byte < len && byte < 8; byte++) {
+							data->d_longlong = (data->d_longlong << 8) | (unsigned char)temp[idx*32+byte];
+						}
+					}
+					else if (_is_decimal_field(&fields[idx])) {
+						data->d_longlong = _parse_decimal(temp + idx*32, len < 32 ? len : 32, MYSQL_DECIMAL_SCALE(result->field_attribs[idx]));
+					}
+					break;
+				case DBI_TYPE_DECIMAL:
+					break;
+				case DBI_TYPE_DATETIME:
+					temp[idx*32 + (len < 32 ? len : 31)] = '\0';
+					sizeattrib = result->field_attribs[idx] & (DBI_DATETIME_DATE|DBI_DATETIME_TIME);
+					data->d_datetime = _dbd_parse_datetime(temp + idx*32, sizeattrib);
+					break;
+				default:
+					/* strings were left out by the fetch, now that we
+					   know the length, fetch them into the row */
+					if ((data->d_string = malloc(len+1)) == NULL) {
+						retval = -1;
+						goto finish;
+					}
+					if (len) {
+						memset(&column, 0, sizeof(MYSQL_BIND));
+						column.buffer_type = binds[idx].buffer_type;
+						column.buffer = data->d_string;
+						column.buffer_length = len;
+						if (mysql_stmt_fetch_column(stmt, &column, idx, 0)) {
+							retval = -1;
+							goto finish;
+						}
+					}
+					data->d_string[len] = '\0';
+					row->field_sizes[idx] = len;
+					if (result->field_types[idx] == DBI_TYPE_BINARY && include_null) {
+						row->field_sizes[idx]++;
+					}
+					break;
+			}
+		}
+	}
+
+finish:
+	free(binds);
+	free(lengths);
+	free(nulls);
+	free(temp);
+	return retval;
+}
+
+unsigned long _real_escape_string(MYSQL *mycon, char *dest, const char *src, unsigned long len) {
+	/* like mysql_real_escape_string(), which Oracle MySQL 5.7.6 and
+	   later refuses to use in the NO_BACKSLASH_ESCAPES SQL mode. In
+	   that mode, the only character to escape is the quote, which is
+	   doubled. No multibyte encoding uses the quote byte inside of
+	   characters, so this is safe for all of them.
+	   returns the length of the escaped string, or (unsigned long)-1 on
+	   error */
+	unsigned long idx;
+	char *out = dest;
+
+#ifdef SERVER_STATUS_NO_BACKSLASH_ESCAPES
+	if (mycon->server_status & SERVER_STATUS_NO_BACKSLASH_ESCAPES) {
+		for (idx = 0; idx < len; idx++) {
+			if (src[idx] == '\'') {
+				*out++ = '\'';
+			}
+			*out++ = src[idx];
+		}
+		*out = '\0';
+		return out - dest;
+	}
+#endif
+	return mysql_real_escape_string(mycon, dest, src, len);
+}
+
+unsigned long _get_max_packet(dbi_conn_t *conn) {
+	/* returns the largest statement the server accepts. This is asked
+	   only once per connection */
+	mysql_conn_data_t *conn_data = (mysql_conn_data_t *)conn->connection;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+	if (!conn_data->max_packet) {
+		if (!mysql_query(&conn_data->mysql, "SELECT @@max_allowed_packet")
+		    && (res = mysql_store_result(&conn_data->mysql)) != NULL) {
+			if ((row = mysql_fetch_row(res)) != NULL && row[0]) {
+				conn_data->max_packet = strtoul(row[0], NULL, 10);
+			}
+			mysql_free_result(res);
+		}
+		if (conn_data->max_packet <= 1024) {
+			conn_data->max_packet = MYSQL_MAX_PACKET_DEFAULT;
+		}
+	}
+	return conn_data->max_packet;
+}
+
+mysql_row_index_t *_get_row_index(dbi_result_t *result, int create) {
+	/* returns the row index of a result, creating it if requested. If
+	   create is zero, the index is removed from the list of the
+	   connection. returns NULL if there is none */
+	mysql_conn_data_t *conn_data = (mysql_conn_data_t *)result->conn->connection;
+	mysql_row_index_t **link;
+	mysql_row_index_t *row_index;
+
+	if (!conn_data) {
+		return NULL;
+	}
+	for (link = &conn_data->row_indexes; (row_index = *link) != NULL; link = &row_index->next) {
+		if (row_index->result == result) {
+			if (!create) {
+				*link = row_index->next;
+			}
+			return row_index;
+		}
+	}
+	if (create && (row_index = calloc(1, sizeof(mysql_row_index_t))) != NULL) {
+		row_index->result = result;
+		row_index->next = conn_data->row_indexes;
+		conn_data->row_indexes = row_index;
+	}
+	return create ? row_index : NULL;
+}
+
+void _free_row_index(mysql_row_index_t *row_index) {
+	if (row_index) {
+		free(row_index->offsets);
+		free(row_index);
+	}
+}
+
+/* LOAD DATA LOCAL INFILE CALLBACKS */
+
+int _infile_init(void **ptr, const char *filename, void *userdata) {
+	/* the file name is ignored, the data come from the application */
+	*ptr = userdata;
+	return 0;
+}
+
+int _infile_read(void *ptr, char *buf, unsigned int buf_len) {
+	/* returns the number of bytes stored in buf, 0 at the end of the
+	   data, -1 on error */
+	mysql_infile_t *infile = (mysql_infile_t *)ptr;
+	size_t n;
+
+	while (infile->buf_pos == infile->buf_len) {
+		if (infile->done) {
+			return 0;
+		}
+		if (_format_infile_row(infile)) {
+			return -1;
+		}
+	}
+
+	n = infile->buf_len - infile->buf_pos;
+	if (n > buf_len) {
+		n = buf_len;
+	}
+	memcpy(buf, infile->buf + infile->buf_pos, n);
+	infile->buf_pos += n;
+	return (int)n;
+}
+
+void _infile_end(void *ptr) {
+	/* dbd_mysql_load_data() owns the state */
+}
+
+int _infile_error(void *ptr, char *error_msg, unsigned int error_msg_len) {
+	mysql_infile_t *infile = (mysql_infile_t *)ptr;
+
+	snprintf(error_msg, error_msg_len, "%s", infile->error ? infile->error : "unknown error");
+	return 2000; /* CR_UNKNOWN_ERROR */
+}
+
+int _format_infile_row(mysql_infile_t *infile) {
+	/* fetches the next row from the application and formats it as a
+	   line of tab-separated values. returns 0 on success, -1 on error */
+	unsigned int idx;
+	size_t needed = 1;		/* the line terminator */
+	size_t len;
+	const unsigned char *src;
+	char *dest;
+	int rc;
+
+	for (idx = 0; idx < infile->n_fields; idx++) {
+		infile->values[idx] = NULL;
+		infile->lengths[idx] = 0;
+	}
+
+	rc = infile->next_row(infile->values, infile->lengths, infile->user_arg);
+	infile->buf_len = infile->buf_pos = 0;
+	if (rc == 0) {
+		infile->done = 1;
+		return 0;
+	}
+	else if (rc < 0) {
+		infile->error = "the row callback failed";
+		return -1;
+	}
+
+	for (idx = 0; idx < infile->n_fields; idx++) {
+		if (infile->values[idx] && !infile->lengths[idx]) {
+			infile->lengths[idx] = strlen(infile->values[idx]);
+		}
+		/* every byte may need an escape, plus the separator */
+		needed += (infile->values[idx] ? 2*infile->lengths[idx] : 2) + 1;
+	}
+
+	if (needed > infile->buf_size) {
+		if ((dest = realloc(infile->buf, needed)) == NULL) {
+			infile->error = "out of memory";
+			return -1;
+		}
+		infile->buf = dest;
+		infile->buf_size = needed;
+	}
+
+	dest = infile->buf;
+	for (idx = 0; idx < infile->n_fields; idx++) {
+		if (idx) {
+			*dest++ = '\t';
+		}
+		if (!infile->values[idx]) {
+			*dest++ = '\\';
+			*dest++ = 'N';
+			continue;
+		}
+		src = (const unsigned char *)infile->values[idx];
+		for (len = infile->lengths[idx]; len; len--, src++) {
+			switch (*src) {
+				case '\\':
+					*dest++ = '\\'; *dest++ = '\\'; break;
+				case '\t':
+					*dest++ = '\\'; *dest++ = 't'; break;
+				case '\n':
+					*dest++ = '\\'; *dest++ = 'n'; break;
+				case '\r':
+					*dest++ = '\\'; *dest++ = 'r'; break;
+				case '\0':
+					*dest++ = '\\'; *dest++ = '0'; break;
+				default:
+					*dest++ = *src; break;
+			}
+		}
+	}
+	*dest++ = '\n';
+	infile->buf_len = dest - infile->buf;
+	return 0;
+}
+
+/* CORE MYSQL DATA FETCHING STUFF */
+
+dbi_result_t *_create_result(dbi_conn_t *conn, MYSQL_RES *res) {
+	dbi_result_t *result;
+
+	/* if res is null, the query was something that doesn't return rows (like an INSERT) */
+	result = _dbd_result_create(conn, (void *)res, (res ? mysql_num_rows(res) : 0), 
+								mysql_affected_rows((MYSQL *)conn->connection));
+
+	if (res) {
+	  _dbd_result_set_numfields(result, mysql_num_fields((MYSQL_RES *)result->result_handle));
+	  _get_field_info(result);
+	}
+
+	return result;
+}
+
+int _is_call(const char *statement) {
+	/* returns 1 if the statement is a CALL, 0 otherwise */
+	const char *keyword = "CALL";
+
+	while (isspace((unsigned char)*statement)) {
+		statement++;
+	}
+	for (; *keyword; keyword++, statement++) {
+		if (toupper((unsigned char)*statement) != *keyword) {
+			return 0;
+		}
+	}
+	return !(isalnum((unsigned char)*statement) || *statement == '_');
+}
+
+void _discard_results(MYSQL *mycon) {
+	/* a multi-statement query or a CALL may return additional results.
+	   These must be read, otherwise the connection refuses further
+	   commands. Errors of the additional statements are lost */
+	while (mysql_more_results(mycon) && mysql_next_result(mycon) == 0) {
+		mysql_free_result(mysql_store_result(mycon));
+	}
+}
+
+void _translate_mysql_type(MYSQL_FIELD *field, unsigned short *type, unsigned int *attribs) {
+	unsigned int _type = 0;
+	unsigned int _attribs = 0;
+
+	switch (field->type) {
+		case FIELD_TYPE_TINY:
+			_type = DBI_TYPE_INTEGER;
+			_attribs |= DBI_INTEGER_SIZE1;
+			break;
+		case FIELD_TYPE_YEAR:
+			_attribs |= DBI_INTEGER_UNSIGNED;
+		case FIELD_TYPE_SHORT:
+			_type = DBI_TYPE_INTEGER;
+			_attribs |= DBI_INTEGER_SIZE2;
+			break;
+		case FIELD_TYPE_INT24:
+			_type = DBI_TYPE_INTEGER;
+			_attribs |= DBI_INTEGER_SIZE3;
+			break;
+		case FIELD_TYPE_LONG:
+			_type = DBI_TYPE_INTEGER;
+			_attribs |= DBI_INTEGER_SIZE4;
+			break;
+#ifdef FIELD_TYPE_BIT
+		case FIELD_TYPE_BIT: // BIT field (MySQL 5.0.3 and up)
+			_attribs |= DBI_INTEGER_UNSIGNED;
+#endif
+		case FIELD_TYPE_LONGLONG:
+			_type = DBI_TYPE_INTEGER;
+			_attribs |= DBI_INTEGER_SIZE8;
+			break;
+			
+		case FIELD_TYPE_FLOAT:
+			_type = DBI_TYPE_DECIMAL;
+			_attribs |= DBI_DECIMAL_SIZE4;
+			break;
+		case FIELD_TYPE_DOUBLE:
+			_type = DBI_TYPE_DECIMAL;
+			_attribs |= DBI_DECIMAL_SIZE8;
+			break;
+			
+		case FIELD_TYPE_DATE: /* TODO parse n stuph to native DBI unixtime type. for now, string */
+			_type = DBI_TYPE_DATETIME;
+			_attribs |= DBI_DATETIME_DATE;
+			break;
+		case FIELD_TYPE_TIME:
+			_type = DBI_TYPE_DATETIME;
+			_attribs |= DBI_DATETIME_TIME;
+			break;
+		case FIELD_TYPE_DATETIME:
+		case FIELD_TYPE_TIMESTAMP:
+			_type = DBI_TYPE_DATETIME;
+			_attribs |= DBI_DATETIME_DATE | DBI_DATETIME_TIME;
+			break;
+			
+		case FIELD_TYPE_VAR_STRING:
+		case FIELD_TYPE_STRING:
+		case FIELD_TYPE_TINY_BLOB:
+		case FIELD_TYPE_MEDIUM_BLOB:
+		case FIELD_TYPE_LONG_BLOB:
+		case FIELD_TYPE_BLOB:
+		default:
+			// see MySQL reference manual 22.2.1 on detecting binary flavour
+			// http://dev.mysql.com/doc/refman/5.0/en/c-api-datatypes.html
+			if(field->charsetnr == 63){
+				_type = DBI_TYPE_BINARY;
+				break;
+			}
+#ifdef FIELD_TYPE_NEWDECIMAL
+		case FIELD_TYPE_NEWDECIMAL: // Precision math DECIMAL or NUMERIC field (MySQL 5.0.3 and up)
+#endif
+		case FIELD_TYPE_DECIMAL: /* decimal is actually a string, has arbitrary precision, no floating point rounding */
+		case FIELD_TYPE_ENUM:
+		case FIELD_TYPE_SET:
+			_type = DBI_TYPE_STRING;
+			break;
+	}
+	
+	*type = _type;
+	*attribs = _attribs;
+}
+
+void _get_field_info(dbi_result_t *result) {
+	unsigned int idx = 0;
+	MYSQL_FIELD *field;
+	unsigned short fieldtype;
+	unsigned int fieldattribs;
+	long precision;
+	int decimal_as_int = (dbi_conn_get_option_numeric(result->conn, "mysql_decimal_as_int") > 0);
+
+	field = mysql_fetch_fields((MYSQL_RES *)result->result_handle);
+	
+	while (idx < result->numfields) {
+		_translate_mysql_type(&field[idx], &fieldtype, &fieldattribs);
+		if (decimal_as_int && _is_decimal_field(&field[idx])) {
+			/* the display length includes the sign and the decimal point */
+			precision = (long)field[idx].length - (field[idx].decimals ? 1 : 0) - ((field[idx].flags & UNSIGNED_FLAG) ? 0 : 1);
+			if (precision <= MYSQL_DECIMAL_MAX_PRECISION && field[idx].decimals <= MYSQL_DECIMAL_MAX_PRECISION) {
+				fieldtype = DBI_TYPE_INTEGER;
+				fieldattribs = DBI_INTEGER_SIZE8 | (field[idx].decimals << MYSQL_DECIMAL_SCALE_SHIFT);
+			}
+		}
+		if ((fieldtype == DBI_TYPE_INTEGER) && (field[idx].flags & UNSIGNED_FLAG)) 
+			fieldattribs |= DBI_INTEGER_UNSIGNED;
+		_dbd_result_add_field(result, idx, field[idx].name, fieldtype, fieldattribs);
+		idx++;
+	}
+}
+
+int _is_decimal_field(MYSQL_FIELD *field) {
+	/* DECIMAL fields are scaled integers if the field info says so */
+	switch (field->type) {
+#ifdef FIELD_TYPE_NEWDECIMAL
+		case FIELD_TYPE_NEWDECIMAL:
+#endif
+		case FIELD_TYPE_DECIMAL:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+long long _parse_decimal(const char *raw, size_t len, unsigned int scale) {
+	/* converts a DECIMAL value like "-123.45" to an integer scaled by
+	   10^scale, i.e. -12345 for a scale of 2 */
+	const char *end = raw + len;
+	long long value = 0;
+	unsigned int frac_digits = 0;
+	int in_frac = 0;
+	int negative = 0;
+
+	if (raw < end && (*raw == '-' || *raw == '+')) {
+		negative = (*raw == '-');
+		raw++;
+	}
+	for (; raw < end; raw++) {
+		if (*raw == '.') {
+			in_frac = 1;
+			continue;
+		}
+		if (*raw < '0' || *raw > '9') {
+			break;
+		}
+		if (in_frac) {
+			if (frac_digits == scale) {
+				break;
+			}
+			frac_digits++;
+		}
+		value = value*10 + (*raw - '0');
+	}
+	for (; frac_digits < scale; frac_digits++) {
+		value *= 10;
+	}
+	return negative ? -value : value;
+}
+
+void _get_row_data(dbi_result_t *result, dbi_row_t *row, unsigned long long rowidx) {
+	MYSQL_RES *_res = result->result_handle;
+	MYSQL_ROW _row;
+	
+	unsigned int curfield = 0;
+	char *raw = NULL;
+	size_t *strsizes = NULL;
+	unsigned int sizeattrib;
+	dbi_data_t *data;	
+
+	_row = mysql_fetch_row(_res);
+	strsizes = (size_t *)mysql_fetch_lengths(_res);
+
+	while (curfield < result->numfields) {
+		raw = _row[curfield];
+		data = &row->field_values[curfield];
+		
+		row->field_sizes[curfield] = 0;
+		/* this will be set to the string size later on if the field is indeed a string */
+
+		if ((strsizes[curfield] == 0) && (raw == NULL)) {
+		        _set_field_flag( row, curfield, DBI_VALUE_NULL, 1);
 			curfield++;
 			continue;
 		}
@@ -731,7 +2275,13 @@ void _get_row_data(dbi_result_t *result, dbi_row_t *row, unsigned long long rowi
 					case DBI_INTEGER_SIZE4:
 						data->d_long = (int) atol(raw); break;
 					case DBI_INTEGER_SIZE8:
-						data->d_longlong = (long long) atoll(raw); break;
+						if (MYSQL_DECIMAL_SCALE(result->field_attribs[curfield])) {
+							data->d_longlong = _parse_decimal(raw, strsizes[curfield], MYSQL_DECIMAL_SCALE(result->field_attribs[curfield]));
+						}
+						else {
+							data->d_longlong = (long long) atoll(raw);
+						}
+						break;
 					default:
 						break;
 				}
@@ -245,6 +245,101 @@
 	"ZEROFILL", \
 	NULL }
 
+/* default number of prepared statements kept per connection */
+#define MYSQL_STMT_CACHE_SIZE	32
+
+/* with the mysql_decimal_as_int option, DECIMAL columns with up to this
+   many digits are returned as 64-bit integers scaled by 10^scale. The
+   scale is kept in the upper bits of the field attributes */
+#define MYSQL_DECIMAL_MAX_PRECISION	18
+#define MYSQL_DECIMAL_SCALE_SHIFT	24
+#define MYSQL_DECIMAL_SCALE(attribs)	(((attribs) >> MYSQL_DECIMAL_SCALE_SHIFT) & 0xff)
+
+/* a prepared statement, cached by its statement text */
+typedef struct mysql_stmt_entry_s {
+	char *statement;
+	MYSQL_STMT *stmt;
+	struct mysql_stmt_entry_s *next;
+} mysql_stmt_entry_t;
+
+/* the state of dbd_mysql_load_data() while the server reads the data */
+typedef struct mysql_infile_s {
+	int (*next_row)(const char **values, size_t *lengths, void *user_arg);
+	void *user_arg;
+	unsigned int n_fields;
+	const char **values;
+	size_t *lengths;
+	char *buf;			/* the formatted current row */
+	size_t buf_size;
+	size_t buf_len;
+	size_t buf_pos;			/* bytes already passed to the server */
+	int done;
+	const char *error;
+} mysql_infile_t;
+
+/* row positions of a stored result, for dbd_goto_row() */
+typedef struct mysql_row_index_s {
+	dbi_result_t *result;
+	unsigned long long next_row;	/* the row mysql_fetch_row() returns
+					   next */
+	MYSQL_ROW_OFFSET *offsets;	/* built on the first jump */
+	struct mysql_row_index_s *next;
+} mysql_row_index_t;
+
+/* assumed max_allowed_packet if the server doesn't tell */
+#define MYSQL_MAX_PACKET_DEFAULT	1048576
+
+/* the stages of a query run by dbd_mysql_send_query() */
+#define MYSQL_ASYNC_IDLE	0
+#define MYSQL_ASYNC_QUERY	1	/* sending the query */
+#define MYSQL_ASYNC_STORE	2	/* receiving the result */
+#define MYSQL_ASYNC_DONE	3	/* the result can be retrieved */
+
+#ifdef HAVE_PTHREAD_H
+/* a row copied by the read-ahead thread of dbd_mysql_stream_query() */
+typedef struct mysql_read_ahead_row_s {
+	const char **values;
+	unsigned long *lengths;
+	char *buf;			/* holds the values */
+	size_t buf_size;
+} mysql_read_ahead_row_t;
+
+/* the queue between the read-ahead thread and the caller */
+typedef struct mysql_read_ahead_s {
+	MYSQL_RES *res;
+	unsigned int n_fields;
+	mysql_read_ahead_row_t *rows;	/* ring buffer of depth rows */
+	unsigned int depth;
+	unsigned int head;		/* the next row for the callback */
+	unsigned int count;		/* rows in the queue */
+	int done;			/* the thread has read all rows */
+	int stop;			/* the callback wants no more rows */
+	int nomem;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} mysql_read_ahead_t;
+#endif
+
+/* per-connection driver data. The MYSQL handle is embedded as the first
+   member, so conn->connection can be used as a MYSQL pointer as well */
+typedef struct mysql_conn_data_s {
+	MYSQL mysql;
+	int busy;			/* a result is being streamed or a
+					   query runs asynchronously */
+	int async_state;
+	int nonblock;			/* MYSQL_OPT_NONBLOCK is set */
+	MYSQL_RES *async_res;
+	unsigned long max_packet;	/* max_allowed_packet, 0 if unknown */
+	char *encoding;			/* IANA name, NULL if not looked up
+					   yet */
+	mysql_stmt_entry_t *stmts;	/* most recently used first */
+	unsigned int n_stmts;
+	unsigned long stmt_hits;
+	unsigned long stmt_misses;
+	mysql_row_index_t *row_indexes;
+} mysql_conn_data_t;
+
 #define MYSQL_CUSTOM_FUNCTIONS { \
         "my_init", \
         "mysql_affected_rows", \
@@ -324,4 +419,41 @@
         "mysql_thread_safe", \
         "mysql_use_result", \
         "mysql_warning_count", \
+        "dbd_mysql_stream_query", \
+        "dbd_mysql_execute_params", \
+        "dbd_mysql_get_stmt_stats", \
+        "dbd_mysql_batch_query", \
+        "dbd_mysql_load_data", \
+        "dbd_mysql_send_query", \
+        "dbd_mysql_continue", \
+        "dbd_mysql_get_result", \
+        "dbd_mysql_get_timeout", \
+        "dbd_mysql_insert_rows", \
         NULL}
+
+/* driver-specific functions, see MYSQL_CUSTOM_FUNCTIONS */
+
+/* receives a row of a streamed result. values and lengths hold the raw
+   field values as sent by the server, NULL values are NULL pointers.
+   Return 0 to continue, anything else to stop */
+typedef int (*dbd_mysql_row_func)(dbi_result Result, const char **values, const unsigned long *lengths, void *user_arg);
+
+/* provides the next row for dbd_mysql_load_data(). Set values[i] to NULL
+   for SQL NULL, and lengths[i] for values which are not null-terminated.
+   Return 1 if a row was provided, 0 at the end of the data, or -1 on
+   error */
+typedef int (*dbd_mysql_load_func)(const char **values, size_t *lengths, void *user_arg);
+
+/* is told about each INSERT statement sent by dbd_mysql_insert_rows() */
+typedef void (*dbd_mysql_batch_func)(unsigned long long n_rows, unsigned long long affected_rows, void *user_arg);
+
+long long dbd_mysql_stream_query(dbi_conn Conn, const char *statement, dbd_mysql_row_func callback, void *user_arg);
+dbi_result dbd_mysql_execute_params(dbi_conn Conn, const char *statement, unsigned int n_params, const char * const *param_values);
+int dbd_mysql_get_stmt_stats(dbi_conn Conn, unsigned long *hits, unsigned long *misses, unsigned int *n_cached);
+int dbd_mysql_batch_query(dbi_conn Conn, const char **statements, size_t n_statements, dbi_result *results, size_t *failed_idx);
+long long dbd_mysql_load_data(dbi_conn Conn, const char *table, const char *columns, unsigned int n_fields, dbd_mysql_load_func next_row, void *user_arg);
+int dbd_mysql_send_query(dbi_conn Conn, const char *statement);
+int dbd_mysql_continue(dbi_conn Conn, int ready_status);
+dbi_result dbd_mysql_get_result(dbi_conn Conn);
+unsigned int dbd_mysql_get_timeout(dbi_conn Conn);
+long long dbd_mysql_insert_rows(dbi_conn Conn, const char *table, const char *columns, unsigned int n_fields, dbd_mysql_load_func next_row, dbd_mysql_batch_func batch_done, void *user_arg, int transaction);
@@ -48,12 +48,28 @@ long long strtoll(const char *nptr, char **endptr, int base);
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h> /* for isdigit() */
+#include <time.h>
+#include <sys/time.h> /* for gettimeofday() */
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#elif defined(__MINGW32__)
+#include <winsock.h>
+#else
+#include <sys/select.h>
+#endif
 
 #include <dbi/dbi.h>
 #include <dbi/dbi-dev.h>
 #include <dbi/dbd.h>
 
 #include <libpq-fe.h>
+#include <libpq/libpq-fs.h> /* for INV_READ, INV_WRITE */
+#ifdef HAVE_PQREGISTEREVENTPROC
+#include <libpq-events.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "dbd_pgsql.h"
 
 static const dbi_info_t driver_info = {
@@ -67,6 +83,7 @@ static const dbi_info_t driver_info = {
 
 static const char *custom_functions[] = PGSQL_CUSTOM_FUNCTIONS;
 static const char *reserved_words[] = PGSQL_RESERVED_WORDS;
+static const char *driver_options[] = PGSQL_DRIVER_OPTIONS;
 
 /* encoding strings, array is terminated by a pair of empty strings */
 static const char pgsql_encoding_hash[][16] = {
@@ -75,6 +92,7 @@ static const char pgsql_encoding_hash[][16] = {
   "EUC_JP", "EUC-JP",
   "EUC_KR", "EUC-KR",
   "UNICODE", "UTF-8",
+  "UTF8", "UTF-8",
   "LATIN1", "ISO-8859-1",
   "LATIN2", "ISO-8859-2",
   "LATIN3", "ISO-8859-3",
@@ -96,10 +114,51 @@ static const char pgsql_encoding_hash[][16] = {
 };
 
 /* forward declarations of internal functions */
-void _translate_postgresql_type(unsigned int oid, unsigned short *type, unsigned int *attribs);
+dbi_result_t *_create_result(dbi_conn_t *conn, PGresult *res);
+dbi_result_t *_exec_query(dbi_conn_t *conn, const char *statement);
+void _translate_postgresql_type(unsigned int oid, int extended, unsigned short *type, unsigned int *attribs);
+unsigned int _resolve_domain(dbi_conn_t *conn, unsigned int oid);
+void _get_field_type(dbi_conn_t *conn, PGresult *res, unsigned int idx, int extended, unsigned short *type, unsigned int *attribs);
 void _get_field_info(dbi_result_t *result);
 void _get_row_data(dbi_result_t *result, dbi_row_t *row, unsigned long long rowidx);
+void _decode_hex(const char *src, size_t len, unsigned char *dest);
 int _dbd_real_connect(dbi_conn_t *conn, const char *db);
+char *_build_conninfo(dbi_conn_t *conn, const char *dbname, const char *host, const char *port);
+int _finish_connect(dbi_conn_t *conn, PGconn *pgconn, const char *dbname);
+PGconn *_race_hosts(dbi_conn_t *conn, const char *dbname, const char *hosts);
+void _poll_connects(PGconn **pgconns, PostgresPollingStatusType *status, int n_conns, int timeout, int want_first);
+int _is_driver_option(const char *optname);
+int _wait_socket(PGconn *pgconn, int for_read, int for_write, int timeout_ms);
+int _reset_conn(dbi_conn_t *conn);
+int _get_seq_block_size(dbi_conn_t *conn, const char *sequence);
+pgsql_seq_block_t *_find_seq_block(pgsql_conn_data_t *conn_data, const char *sequence, int create);
+int _fill_seq_block(dbi_conn_t *conn, pgsql_seq_block_t *seq_block, int block_size);
+void _free_idle_conns(pgsql_idle_conn_t *idle_conns);
+int _is_select(const char *statement);
+size_t _word_at(const char *pos, const char *word);
+const char *_find_word(const char *statement, const char *word);
+dbi_result_t *_cursor_query(dbi_conn_t *conn, pgsql_conn_data_t *conn_data, const char *statement, int page_size);
+pgsql_cursor_t *_find_cursor(dbi_result_t *result, int unlink);
+PGresult *_fetch_page(pgsql_cursor_t *cursor, unsigned long long first_row, int known_open);
+int _cursor_usable(pgsql_cursor_t *cursor);
+void _close_cursor(pgsql_cursor_t *cursor, int known_open);
+pgsql_cursor_t *_detach_cursors(pgsql_conn_data_t *conn_data);
+pgsql_stmt_t *_find_stmt(pgsql_conn_data_t *conn_data, const char *stmt_name, int unlink);
+void _free_stmt(pgsql_stmt_t *stmt);
+pgsql_stmt_t *_describe_stmt(dbi_conn_t *conn, const char *stmt_name);
+int _lo_begin(PGconn *pgconn);
+int _lo_end(PGconn *pgconn, int started, int success);
+int _lo_seek(PGconn *pgconn, int fd, long long offset);
+PGconn *_take_idle_conn(pgsql_idle_conn_t **idle_conns, const char *db, int timeout);
+pgsql_idle_conn_t *_park_idle_conn(pgsql_idle_conn_t *idle_conns, PGconn *pgconn, const char *db, int capacity);
+pgsql_conn_data_t *_get_conn_data(PGconn *pgconn);
+void _free_conn_data(pgsql_conn_data_t *conn_data);
+pgsql_type_t *_find_type(pgsql_conn_data_t *conn_data, unsigned int oid);
+int _add_type(pgsql_conn_data_t *conn_data, unsigned int oid, unsigned int basetype);
+int _load_types(dbi_conn_t *conn, pgsql_conn_data_t *conn_data);
+#ifdef HAVE_PQREGISTEREVENTPROC
+int _event_proc(PGEventId evtId, void *evtInfo, void *passThrough);
+#endif
 
 /* this function is available through the PostgreSQL client library, but it
    is not declared in any of their headers. I hope this won't break anything */
@@ -151,11 +210,41 @@ int dbd_connect(dbi_conn_t *conn) {
 
 int _dbd_real_connect(dbi_conn_t *conn, const char *db) {
 	const char *dbname;
-	const char *encoding = dbi_conn_get_option(conn, "encoding");
+	const char *hosts = dbi_conn_get_option(conn, "host");
 
 	PGconn *pgconn;
 	char *conninfo = NULL;
 
+	if (db && *db) {
+	  dbname = db;
+	}
+	else {
+	  dbname = dbi_conn_get_option(conn, "dbname");
+	}
+
+	if (hosts && strchr(hosts, ',') && dbi_conn_get_option_numeric(conn, "pgsql_host_race") > 0) {
+	  if ((pgconn = _race_hosts(conn, dbname, hosts)) == NULL) {
+	    return -2;
+	  }
+	}
+	else {
+	  conninfo = _build_conninfo(conn, dbname, NULL, NULL);
+
+	  /* send an empty string instead of NULL if there are no options */
+	  pgconn = PQconnectdb(conninfo ? conninfo : "");
+	  if (conninfo) free(conninfo);
+	  if (!pgconn) return -1;
+	}
+
+	return _finish_connect(conn, pgconn, dbname);
+}
+
+char *_build_conninfo(dbi_conn_t *conn, const char *dbname, const char *host, const char *port) {
+	/* returns the conninfo string for the connection options, or NULL
+	   if there are none. If host is not NULL, it replaces the "host"
+	   option, and port replaces the "port" option likewise */
+	char *conninfo = NULL;
+
 	const char *optname = NULL;
 	const char *pgopt;
 	const char *optval;
@@ -171,6 +260,16 @@ int _dbd_real_connect(dbi_conn_t *conn, const char *db) {
 	    continue;
 	  }
 
+	  /* Options meant for the driver, not for libpq */
+	  else if ( _is_driver_option( pgopt ) ) {
+	    continue;
+	  }
+
+	  /* Options we were asked to replace */
+	  else if ( ( host && !strcmp( pgopt, "host" ) ) || ( port && !strcmp( pgopt, "port" ) ) ) {
+	    continue;
+	  }
+
 	  /* Map "username" to "user" */
 	  else if( !strcmp( pgopt, "username" ) ) {
 	    pgopt = "user";
@@ -203,22 +302,24 @@ int _dbd_real_connect(dbi_conn_t *conn, const char *db) {
 	  }
 	}
 
-	if (db && *db) {
-	  dbname = db;
-	}
-	else {
-	  dbname = dbi_conn_get_option(conn, "dbname");
-	}
+	if( host )
+		CONNINFO_APPEND_ESCAPED( conninfo, "%s='%s'", "host", host );
+
+	if( port )
+		CONNINFO_APPEND_ESCAPED( conninfo, "%s='%s'", "port", port );
 
 	if( dbname )
 		CONNINFO_APPEND_ESCAPED( conninfo, "%s='%s'", "dbname", dbname );
 
-	/* send an empty string instead of NULL if there are no options */
-	pgconn = PQconnectdb(conninfo ? conninfo : "");
-	if (conninfo) free(conninfo);
-	if (!pgconn) return -1;
+	return conninfo;
+}
+
+int _finish_connect(dbi_conn_t *conn, PGconn *pgconn, const char *dbname) {
+	/* takes over a PGconn, either established or failed.
+	   returns 0 on success, -2 if the connection failed */
+	const char *encoding = dbi_conn_get_option(conn, "encoding");
 
-	if (PQstatus(pgconn) == CONNECTION_BAD) {
+	if (PQstatus(pgconn) != CONNECTION_OK) {
 		conn->connection = (void *)pgconn; // still need this set so _error_handler can grab information
 		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
 		PQfinish(pgconn);
@@ -229,6 +330,12 @@ int _dbd_real_connect(dbi_conn_t *conn, const char *db) {
 		conn->connection = (void *)pgconn;
 		if (dbname) conn->current_db = strdup(dbname);
 	}
+
+#ifdef HAVE_PQREGISTEREVENTPROC
+	/* attach our per-connection data. If this fails, the features
+	   which depend on it are silently disabled */
+	PQregisterEventProc(pgconn, _event_proc, "dbd_pgsql", NULL);
+#endif
 	
 	if (encoding && *encoding) {
 	  /* set connection encoding */
@@ -244,6 +351,196 @@ int _dbd_real_connect(dbi_conn_t *conn, const char *db) {
 	return 0;
 }
 
+PGconn *_race_hosts(dbi_conn_t *conn, const char *dbname, const char *hosts) {
+	/* connects to all hosts of the comma-separated list at the same time
+	   and keeps the first connection that succeeds. A comma-separated
+	   "port" option provides one port per host. Hosts beyond the end
+	   of the list use its last port, as libpq does with a single port.
+	   returns the connection, which may be a failed one to report the
+	   error from, or NULL if all attempts timed out */
+	const char *ports = dbi_conn_get_option(conn, "port");
+	char *hostlist = strdup(hosts);
+	char *portlist = (ports && strchr(ports, ',')) ? strdup(ports) : NULL;
+	char *host;
+	char *port;
+	char *conninfo;
+	PGconn **pgconns = NULL;
+	PostgresPollingStatusType *status = NULL;
+	PGconn *pgconn = NULL;
+	int n_hosts = 1;
+	int idx;
+
+	for (host = hostlist; host && (host = strchr(host, ',')) != NULL; host++) {
+		n_hosts++;
+	}
+
+	if (!hostlist || (ports && strchr(ports, ',') && !portlist)
+	    || (pgconns = calloc(n_hosts, sizeof(PGconn *))) == NULL
+	    || (status = calloc(n_hosts, sizeof(PostgresPollingStatusType))) == NULL) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		free(hostlist);
+		free(portlist);
+		free(pgconns);
+		return NULL;
+	}
+
+	host = hostlist;
+	port = portlist;
+	for (idx = 0; idx < n_hosts; idx++) {
+		char *nexthost = strchr(host, ',');
+		char *nextport = port ? strchr(port, ',') : NULL;
+
+		if (nexthost) *nexthost++ = '\0';
+		if (nextport) *nextport++ = '\0';
+
+		conninfo = _build_conninfo(conn, dbname, host, port);
+		pgconns[idx] = PQconnectStart(conninfo ? conninfo : "");
+		if (conninfo) free(conninfo);
+
+		host = nexthost;
+		if (nextport) {
+			port = nextport;
+		}
+	}
+
+	_poll_connects(pgconns, status, n_hosts, dbi_conn_get_option_numeric(conn, "timeout"), 1);
+
+	/* keep the winner, or else the first failure to report its error */
+	for (idx = 0; idx < n_hosts; idx++) {
+		if (status[idx] == PGRES_POLLING_OK) {
+			pgconn = pgconns[idx];
+			break;
+		}
+	}
+	for (idx = 0; idx < n_hosts && !pgconn; idx++) {
+		if (pgconns[idx] && PQstatus(pgconns[idx]) == CONNECTION_BAD) {
+			pgconn = pgconns[idx];
+		}
+	}
+	for (idx = 0; idx < n_hosts; idx++) {
+		if (pgconns[idx] && pgconns[idx] != pgconn) {
+			PQfinish(pgconns[idx]);
+		}
+	}
+
+	if (!pgconn) {
+		_dbd_internal_error_handler(conn, "timeout expired", DBI_ERROR_NOCONN);
+	}
+
+	free(hostlist);
+	free(portlist);
+	free(pgconns);
+	free(status);
+	return pgconn;
+}
+
+void _poll_connects(PGconn **pgconns, PostgresPollingStatusType *status, int n_conns, int timeout, int want_first) {
+	/* drives connection attempts started by PQconnectStart() at the same
+	   time, for at most timeout seconds if positive. If want_first is
+	   nonzero, returns as soon as one connection is established. On
+	   return, status holds PGRES_POLLING_OK or PGRES_POLLING_FAILED for
+	   the finished attempts, other values for those still in progress */
+	struct timeval start;
+	struct timeval now;
+	int wait_ms = -1;
+	int pending;
+	int idx;
+#ifdef HAVE_POLL_H
+	struct pollfd *pfds;
+	int *pfd_conn;
+#else
+	fd_set readfds;
+	fd_set writefds;
+	struct timeval tv;
+	int maxfd;
+	int sock;
+#endif
+
+	for (idx = 0; idx < n_conns; idx++) {
+		status[idx] = (pgconns[idx] && PQstatus(pgconns[idx]) != CONNECTION_BAD) ? PGRES_POLLING_WRITING : PGRES_POLLING_FAILED;
+	}
+
+#ifdef HAVE_POLL_H
+	pfds = malloc(n_conns * sizeof(struct pollfd));
+	pfd_conn = malloc(n_conns * sizeof(int));
+	if (!pfds || !pfd_conn) {
+		free(pfds);
+		free(pfd_conn);
+		return;
+	}
+#endif
+
+	gettimeofday(&start, NULL);
+
+	for (;;) {
+		if (timeout > 0) {
+			gettimeofday(&now, NULL);
+			wait_ms = timeout * 1000 - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000);
+			if (wait_ms <= 0) {
+				break;
+			}
+		}
+
+		pending = 0;
+#ifdef HAVE_POLL_H
+		for (idx = 0; idx < n_conns; idx++) {
+			if (status[idx] == PGRES_POLLING_READING || status[idx] == PGRES_POLLING_WRITING) {
+				pfds[pending].fd = PQsocket(pgconns[idx]);
+				pfds[pending].events = (status[idx] == PGRES_POLLING_READING) ? POLLIN : POLLOUT;
+				pfds[pending].revents = 0;
+				pfd_conn[pending++] = idx;
+			}
+		}
+		if (!pending || poll(pfds, pending, wait_ms) < 0) {
+			break;
+		}
+		for (idx = 0; idx < pending; idx++) {
+			if (pfds[idx].revents) {
+				status[pfd_conn[idx]] = PQconnectPoll(pgconns[pfd_conn[idx]]);
+				if (want_first && status[pfd_conn[idx]] == PGRES_POLLING_OK) {
+					free(pfds);
+					free(pfd_conn);
+					return;
+				}
+			}
+		}
+#else
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		maxfd = -1;
+		for (idx = 0; idx < n_conns; idx++) {
+			if (status[idx] == PGRES_POLLING_READING || status[idx] == PGRES_POLLING_WRITING) {
+				sock = PQsocket(pgconns[idx]);
+				FD_SET(sock, (status[idx] == PGRES_POLLING_READING) ? &readfds : &writefds);
+				if (sock > maxfd) maxfd = sock;
+				pending++;
+			}
+		}
+		tv.tv_sec = wait_ms / 1000;
+		tv.tv_usec = (wait_ms % 1000) * 1000;
+		if (!pending || select(maxfd+1, &readfds, &writefds, NULL, (wait_ms < 0) ? NULL : &tv) < 0) {
+			break;
+		}
+		for (idx = 0; idx < n_conns; idx++) {
+			if (status[idx] == PGRES_POLLING_READING || status[idx] == PGRES_POLLING_WRITING) {
+				sock = PQsocket(pgconns[idx]);
+				if (FD_ISSET(sock, &readfds) || FD_ISSET(sock, &writefds)) {
+					status[idx] = PQconnectPoll(pgconns[idx]);
+					if (want_first && status[idx] == PGRES_POLLING_OK) {
+						return;
+					}
+				}
+			}
+		}
+#endif
+	}
+
+#ifdef HAVE_POLL_H
+	free(pfds);
+	free(pfd_conn);
+#endif
+}
+
 int dbd_disconnect(dbi_conn_t *conn) {
 	if (conn->connection) PQfinish((PGconn *)conn->connection);
 	return 0;
@@ -251,13 +548,32 @@ int dbd_disconnect(dbi_conn_t *conn) {
 
 int dbd_fetch_row(dbi_result_t *result, unsigned long long rowidx) {
 	dbi_row_t *row = NULL;
+	pgsql_cursor_t *cursor;
+	unsigned long long pagerow = rowidx;
 
 	if (result->result_state == NOTHING_RETURNED) return 0;
 	
 	if (result->result_state == ROWS_RETURNED) {
+		if ((cursor = _find_cursor(result, 0)) != NULL) {
+			/* fetch the page holding the row unless we have it already */
+			if (rowidx < cursor->first_row
+			    || rowidx >= cursor->first_row + PQntuples((PGresult *)result->result_handle)) {
+				/* release the old page before fetching the next one */
+				PQclear((PGresult *)result->result_handle);
+				if ((result->result_handle = (void *)_fetch_page(cursor, rowidx, 0)) == NULL) {
+					return 0;
+				}
+			}
+			pagerow = rowidx - cursor->first_row;
+		}
+		if (pagerow >= (unsigned long long)PQntuples((PGresult *)result->result_handle)) {
+			/* a cursor result whose connection was switched away */
+			return 0;
+		}
+
 		/* get row here */
 		row = _dbd_row_allocate(result->numfields);
-		_get_row_data(result, row, rowidx);
+		_get_row_data(result, row, pagerow);
 		_dbd_row_finalize(result, row, rowidx);
 	}
 	
@@ -265,6 +581,14 @@ int dbd_fetch_row(dbi_result_t *result, unsigned long long rowidx) {
 }
 
 int dbd_free_query(dbi_result_t *result) {
+	pgsql_cursor_t *cursor;
+
+	if ((cursor = _find_cursor(result, 1)) != NULL) {
+		if (cursor->pgconn) {
+			_close_cursor(cursor, 0);
+		}
+		free(cursor);
+	}
 	PQclear((PGresult *)result->result_handle);
 	return 0;
 }
@@ -285,7 +609,7 @@ int dbd_get_socket(dbi_conn_t *conn)
 }
 
 const char *dbd_get_encoding(dbi_conn_t *conn){
-	const char* my_enc;
+	const char* my_enc = NULL;
 	int n_encoding;
 	const char* encodingopt;
 	char* sql_cmd;
@@ -310,7 +634,9 @@ const char *dbd_get_encoding(dbi_conn_t *conn){
 	  my_enc = pg_encoding_to_char(PQclientEncoding(pgconn));
 /*  	  printf("use PQclientEncoding, %s\n", encodingopt); */
 	}
-	else {
+	else if ((my_enc = PQparameterStatus(pgconn, "server_encoding")) == NULL) {
+	  /* protocol versions before 3.0 (pre-7.4 servers) do not report
+	     the database encoding during the connection startup */
 	  asprintf(&sql_cmd, "SELECT encoding FROM pg_database WHERE datname='%s'", conn->current_db);
 	  
 	  dbires = dbi_conn_query(conn, sql_cmd);
@@ -321,6 +647,9 @@ const char *dbd_get_encoding(dbi_conn_t *conn){
 	    my_enc = pg_encoding_to_char(n_encoding);
 /*  	    printf("select returned encoding %d<<%s\n", n_encoding, my_enc); */
 	  }
+	  if (dbires) {
+	    dbi_result_free(dbires);
+	  }
 	}
 
 	if (!my_enc) {
@@ -366,11 +695,27 @@ const char* dbd_encoding_from_iana(const char *iana_encoding) {
 char *dbd_get_engine_version(dbi_conn_t *conn, char *versionstring) {
   dbi_result_t *dbi_result;
   const char *versioninfo = NULL;
+  int version;
 
   /* initialize return string */
   *versionstring = '\0';
 
-  dbi_result = dbd_query(conn, "SELECT VERSION()");
+  /* libpq learns the server version during the connection startup,
+     so we don't need a round trip. The number looks like 80001 for
+     8.0.1, or like 150004 for 15.4 in the two-part scheme used since
+     version 10 */
+  version = PQserverVersion((PGconn *)conn->connection);
+  if (version >= 100000) {
+    snprintf(versionstring, VERSIONSTRING_LENGTH, "%d.%d", version / 10000, version % 10000);
+    return versionstring;
+  }
+  else if (version > 0) {
+    snprintf(versionstring, VERSIONSTRING_LENGTH, "%d.%d.%d", version / 10000, (version / 100) % 100, version % 100);
+    return versionstring;
+  }
+
+  /* pre-7.4 server, ask it */
+  dbi_result = _exec_query(conn, "SELECT VERSION()");
 
   /* this query will return something like:
      PostgreSQL 8.0.1 on i386-portbld-freebsd5.4, compiled by GCC cc (GCC) 3.4.2 [FreeBSD] 20040728
@@ -414,11 +759,11 @@ dbi_result_t *dbd_list_dbs(dbi_conn_t *conn, const char *pattern) {
 	char *sql_cmd;
 
 	if (pattern == NULL) {
-		return dbd_query(conn, "SELECT datname FROM pg_database");
+		return _exec_query(conn, "SELECT datname FROM pg_database");
 	}
 	else {
 		asprintf(&sql_cmd, "SELECT datname FROM pg_database WHERE datname LIKE '%s'", pattern);
-		res = dbd_query(conn, sql_cmd);
+		res = _exec_query(conn, sql_cmd);
 		free(sql_cmd);
 		return res;
 	}
@@ -486,10 +831,24 @@ dbi_result_t *dbd_query(dbi_conn_t *conn, const char *statement) {
 	 * result_handle, numrows_matched, and numrows_changed.
 	 * everything else will be filled in by DBI */
 	
+	int page_size = dbi_conn_get_option_numeric(conn, "pgsql_cursor_fetch");
+	pgsql_conn_data_t *conn_data;
+
+	if (page_size > 0 && _is_select(statement)
+	    && (conn_data = _get_conn_data((PGconn *)conn->connection)) != NULL) {
+		return _cursor_query(conn, conn_data, statement, page_size);
+	}
+
+	return _exec_query(conn, statement);
+}
+
+dbi_result_t *_exec_query(dbi_conn_t *conn, const char *statement) {
+	/* runs a statement the plain way. The driver uses this for its own
+	   queries, which are small and must not be run through a cursor */
 	dbi_result_t *result;
 	PGresult *res;
 	int resstatus;
-	
+
 	res = PQexec((PGconn *)conn->connection, statement);
 	if (res) resstatus = PQresultStatus(res);
 	if (!res || ((resstatus != PGRES_COMMAND_OK) && (resstatus != PGRES_TUPLES_OK) && (resstatus != PGRES_COPY_OUT) && (resstatus != PGRES_COPY_IN))) {
@@ -497,9 +856,7 @@ dbi_result_t *dbd_query(dbi_conn_t *conn, const char *statement) {
 		return NULL;
 	}
 
-	result = _dbd_result_create(conn, (void *)res, (unsigned long long)PQntuples(res), (unsigned long long)atoll(PQcmdTuples(res)));
-	_dbd_result_set_numfields(result, (unsigned int)PQnfields((PGresult *)result->result_handle));
-	_get_field_info(result);
+	result = _create_result(conn, res);
 
 	return result;
 }
@@ -509,17 +866,69 @@ dbi_result_t *dbd_query_null(dbi_conn_t *conn, const unsigned char *statement, s
 }
 
 const char *dbd_select_db(dbi_conn_t *conn, const char *db) {
-  /* postgresql doesn't support switching databases without reconnecting */
+  /* postgresql doesn't support switching databases without reconnecting.
+     If pgsql_idle_conns is set, we keep that many connections to other
+     databases open and switch back to them if asked to */
+  int capacity = dbi_conn_get_option_numeric(conn, "pgsql_idle_conns");
+  int timeout = dbi_conn_get_option_numeric(conn, "pgsql_idle_timeout");
+  pgsql_conn_data_t *conn_data;
+  pgsql_idle_conn_t *idle_conns = NULL;
+  pgsql_cursor_t *cursors = NULL;
+  pgsql_cursor_t *cursor;
+  PGconn *pgconn = NULL;
+
   if (!db || !*db) {
     return NULL;
   }
 
   if (conn->connection) {
-    PQfinish((PGconn *)conn->connection);
+    conn_data = _get_conn_data((PGconn *)conn->connection);
+    /* pending results can't page any further, but they still need
+       their cursor entries to map rows to their last page */
+    cursors = _detach_cursors(conn_data);
+    if (capacity > 0 && conn_data) {
+      idle_conns = conn_data->idle_conns;
+      conn_data->idle_conns = NULL;
+      pgconn = _take_idle_conn(&idle_conns, db, timeout);
+      idle_conns = _park_idle_conn(idle_conns, (PGconn *)conn->connection, conn->current_db, capacity);
+    }
+    else {
+      PQfinish((PGconn *)conn->connection);
+    }
     conn->connection = NULL;
   }
 
-  if (_dbd_real_connect(conn, db)) {
+  if (pgconn) {
+    conn->connection = (void *)pgconn;
+    if (conn->current_db) {
+      free(conn->current_db);
+    }
+    conn->current_db = strdup(db);
+  }
+  else if (_dbd_real_connect(conn, db)) {
+    _free_idle_conns(idle_conns);
+    goto free_cursors;
+  }
+
+  if ((conn_data = _get_conn_data((PGconn *)conn->connection)) != NULL) {
+    conn_data->idle_conns = idle_conns;
+    if (cursors) {
+      for (cursor = cursors; cursor->next; cursor = cursor->next);
+      cursor->next = conn_data->cursors;
+      conn_data->cursors = cursors;
+      cursors = NULL;
+    }
+  }
+  else {
+    _free_idle_conns(idle_conns);
+  }
+
+free_cursors:
+  while ((cursor = cursors) != NULL) {
+    cursors = cursor->next;
+    free(cursor);
+  }
+  if (!conn->connection) {
     return NULL;
   }
 
@@ -541,10 +950,18 @@ unsigned long long dbd_get_seq_last(dbi_conn_t *conn, const char *sequence) {
 	char *sql_cmd;
 	char *rawdata;
 	dbi_result_t *result;
+	pgsql_conn_data_t *conn_data = _get_conn_data((PGconn *)conn->connection);
+	pgsql_seq_block_t *seq_block;
+
+	/* if we hand out values from a block, currval() would report the
+	   last value of the block instead of the last one we handed out */
+	if (conn_data && (seq_block = _find_seq_block(conn_data, sequence, 0)) != NULL && seq_block->have_last) {
+		return seq_block->last;
+	}
 
 	asprintf(&sql_cmd, "SELECT currval('%s')", sequence);
 	if (!sql_cmd) return 0;
-	result = dbd_query(conn, sql_cmd);
+	result = _exec_query(conn, sql_cmd);
 	free(sql_cmd);
 
 	if (result) {
@@ -563,10 +980,22 @@ unsigned long long dbd_get_seq_next(dbi_conn_t *conn, const char *sequence) {
 	char *sql_cmd;
 	char *rawdata;
 	dbi_result_t *result;
+	pgsql_conn_data_t *conn_data = _get_conn_data((PGconn *)conn->connection);
+	pgsql_seq_block_t *seq_block;
+	int block_size = _get_seq_block_size(conn, sequence);
+
+	if (conn_data && block_size > 1 && (seq_block = _find_seq_block(conn_data, sequence, 1)) != NULL) {
+		if (seq_block->next < seq_block->n_values || !_fill_seq_block(conn, seq_block, block_size)) {
+			seq_block->last = seq_block->values[seq_block->next++];
+			seq_block->have_last = 1;
+			return seq_block->last;
+		}
+		return 0;
+	}
 
 	asprintf(&sql_cmd, "SELECT nextval('%s')", sequence);
 	if (!sql_cmd) return 0;
-	result = dbd_query(conn, sql_cmd);
+	result = _exec_query(conn, sql_cmd);
 	free(sql_cmd);
 
 	if (result) {	
@@ -582,137 +1011,1629 @@ unsigned long long dbd_get_seq_next(dbi_conn_t *conn, const char *sequence) {
 
 int dbd_ping(dbi_conn_t *conn) {
 	PGconn *pgsql = (PGconn *)conn->connection;
+	pgsql_conn_data_t *conn_data = _get_conn_data(pgsql);
 	PGresult *res;
+	int idle = dbi_conn_get_option_numeric(conn, "pgsql_ping_idle");
 
-	res = PQexec(pgsql, "SELECT 1");
-	if (res) {
-	  PQclear (res);
+	if (conn_data) {
+		conn_data->pings++;
 	}
 
 	if (PQstatus(pgsql) == CONNECTION_OK) {
-		return 1;
+		/* a readable socket means the server either sent something
+		   or closed the connection. PQconsumeInput() tells which */
+		if (_wait_socket(pgsql, 1, 0, 0) > 0 && !PQconsumeInput(pgsql)) {
+			/* dead, fall through to the reconnect */
+		}
+		else if (conn_data && idle > 0 && time(NULL) - conn_data->last_activity < idle) {
+			/* the server answered recently, spare the round trip */
+			return 1;
+		}
+		else {
+			res = PQexec(pgsql, "SELECT 1");
+			if (res) {
+			  PQclear (res);
+			}
+
+			if (PQstatus(pgsql) == CONNECTION_OK) {
+				if (conn_data) {
+					conn_data->last_activity = time(NULL);
+				}
+				return 1;
+			}
+		}
 	}
 
-	PQreset(pgsql); // attempt a reconnection
-	
-	if (PQstatus(pgsql) == CONNECTION_OK) {
-		return 1;
+	/* attempt a reconnection */
+	return _reset_conn(conn);
+}
+
+/* DRIVER-SPECIFIC FUNCTIONS, available through dbi_driver_specific_function() */
+
+int dbd_pgsql_batch_query(dbi_conn Conn, const char **statements, size_t n_statements, dbi_result *results, size_t *failed_idx) {
+	/* sends all statements in one go using libpq's pipeline mode and
+	 * collects their results afterwards. results must provide room for
+	 * n_statements results. The statements are separated by a single
+	 * sync point, so unless the batch manages transactions itself it
+	 * runs as one implicit transaction. The first failing statement
+	 * aborts the remainder of the batch; its index is stored in
+	 * failed_idx (n_statements if all succeeded).
+	 * returns 0 on success, -1 on error */
+	dbi_conn_t *conn = Conn;
+	size_t idx;
+
+	if (failed_idx) *failed_idx = n_statements;
+	for (idx = 0; idx < n_statements; idx++) {
+		results[idx] = NULL;
 	}
 
-	return 0;
-}
+#ifdef HAVE_PQENTERPIPELINEMODE
+	{
+	PGconn *pgconn = (PGconn *)conn->connection;
+	PGresult *res;
+	int resstatus;
+	int flushed;
+	int done = 0;
+	int retval = 0;
+	size_t first_failed = n_statements;
 
-/* CORE POSTGRESQL DATA FETCHING STUFF */
+	if (!pgconn || !n_statements) {
+		return -1;
+	}
 
-void _translate_postgresql_type(unsigned int oid, unsigned short *type, unsigned int *attribs) {
-	unsigned int _type = 0;
-	unsigned int _attribs = 0;
+	/* in non-blocking mode the output buffer grows as needed, which
+	   lets us read results while the server still digests the batch.
+	   A blocking send could deadlock with a server that waits for us
+	   to read its replies */
+	if (PQsetnonblocking(pgconn, 1) || !PQenterPipelineMode(pgconn)) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		PQsetnonblocking(pgconn, 0);
+		return -1;
+	}
 
-/* 	  fprintf(stderr, "oid went to %d\n", oid); */
-	switch (oid) {
-		case PG_TYPE_CHAR:
-			_type = DBI_TYPE_INTEGER;
-			_attribs |= DBI_INTEGER_SIZE1;
-			break;
-		case PG_TYPE_INT2:
-			_type = DBI_TYPE_INTEGER;
-			_attribs |= DBI_INTEGER_SIZE2;
-			break;
-		case PG_TYPE_INT4:
-			_type = DBI_TYPE_INTEGER;
-			_attribs |= DBI_INTEGER_SIZE4;
-			break;
-		case PG_TYPE_INT8:
-			_type = DBI_TYPE_INTEGER;
-			_attribs |= DBI_INTEGER_SIZE8;
-			break;
-		case PG_TYPE_OID:
-			_type = DBI_TYPE_INTEGER;
-			_attribs |= DBI_INTEGER_SIZE8;
-			_attribs |= DBI_INTEGER_UNSIGNED;
-			break;
-			
-		case PG_TYPE_FLOAT4:
-			_type = DBI_TYPE_DECIMAL;
-			_attribs |= DBI_DECIMAL_SIZE4;
-			break;
-		case PG_TYPE_FLOAT8:
-			_type = DBI_TYPE_DECIMAL;
-			_attribs |= DBI_DECIMAL_SIZE8;
+	for (idx = 0; idx < n_statements; idx++) {
+		if (!PQsendQueryParams(pgconn, statements[idx], 0, NULL, NULL, NULL, NULL, 0)) {
 			break;
+		}
+	}
 
-        case PG_TYPE_DATE:
-	        _type = DBI_TYPE_DATETIME;
-            _attribs |= DBI_DATETIME_DATE;
-            break;
-        case PG_TYPE_TIME:
-        case PG_TYPE_TIMETZ:
-            _type = DBI_TYPE_DATETIME;
-            _attribs |= DBI_DATETIME_TIME;
-            break;
-        case PG_TYPE_TIMESTAMP:
-        case PG_TYPE_TIMESTAMPTZ:
-			_type = DBI_TYPE_DATETIME;
-			_attribs |= DBI_DATETIME_DATE;
-			_attribs |= DBI_DATETIME_TIME;
-			break;
+	if (idx < n_statements) {
+		/* collect the results of what was sent, so that we can leave
+		   pipeline mode */
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		first_failed = idx;
+		retval = -1;
+	}
 
-		case PG_TYPE_NAME:
-		case PG_TYPE_TEXT:
-		case PG_TYPE_CHAR2:
-		case PG_TYPE_CHAR4:
-		case PG_TYPE_CHAR8:
-		case PG_TYPE_BPCHAR:
-		case PG_TYPE_VARCHAR:
-			_type = DBI_TYPE_STRING;
+	if (!PQpipelineSync(pgconn)) {
+		idx = 0;
+		goto leave;
+	}
+
+	idx = 0;
+	while (!done) {
+		flushed = PQflush(pgconn);
+		if (flushed < 0) {
 			break;
+		}
 
-		case PG_TYPE_BYTEA:
-			_type = DBI_TYPE_BINARY;
+		while (!done && !PQisBusy(pgconn)) {
+			res = PQgetResult(pgconn);
+			if (!res) {
+				/* end of the results of the current statement */
+				idx++;
+				continue;
+			}
+
+			resstatus = PQresultStatus(res);
+			if (resstatus == PGRES_PIPELINE_SYNC) {
+				done = 1;
+			}
+			else if (resstatus == PGRES_COMMAND_OK || resstatus == PGRES_TUPLES_OK) {
+				if (idx < n_statements && !results[idx]) {
+					results[idx] = (dbi_result)_create_result(conn, res);
+					continue;
+				}
+			}
+			else if (resstatus != PGRES_PIPELINE_ABORTED && idx < first_failed) {
+				/* first error. libpq skips the remaining statements
+				   and returns PGRES_PIPELINE_ABORTED for them */
+				_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+				first_failed = idx;
+				retval = -1;
+			}
+			PQclear(res);
+		}
+
+		if (done) {
 			break;
-			
-		default:
-			_type = DBI_TYPE_STRING;
+		}
+
+		/* an interrupted wait is retried, the connection is fine */
+		if ((_wait_socket(pgconn, 1, flushed, -1) < 0 && PQstatus(pgconn) != CONNECTION_OK)
+		    || !PQconsumeInput(pgconn)) {
 			break;
+		}
 	}
-	
-	*type = _type;
-	*attribs = _attribs;
-}
 
-void _get_field_info(dbi_result_t *result) {
-	unsigned int idx = 0;
-	unsigned int pgOID = 0;
-	char *fieldname;
-	unsigned short fieldtype;
-	unsigned int fieldattribs;
-	
-	while (idx < result->numfields) {
-		pgOID = PQftype((PGresult *)result->result_handle, idx);
-		fieldname = PQfname((PGresult *)result->result_handle, idx);
-		_translate_postgresql_type(pgOID, &fieldtype, &fieldattribs);
-		_dbd_result_add_field(result, idx, fieldname, fieldtype, fieldattribs);
-		idx++;
+leave:
+	if (!done) {
+		/* lost the connection while processing the batch. We don't
+		   reconnect here, as that would block; dbi_conn_ping() does */
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		if (first_failed == n_statements) first_failed = idx;
+		retval = -1;
+	}
+
+	/* later queries fail in pipeline mode. With results pending on a
+	   broken connection this doesn't work, but reconnecting leaves
+	   pipeline mode as well */
+	PQexitPipelineMode(pgconn);
+	PQsetnonblocking(pgconn, 0);
+	if (failed_idx) *failed_idx = first_failed;
+	return retval;
 	}
+#else
+	_dbd_internal_error_handler(conn, "pipeline mode requires libpq 14 or later", DBI_ERROR_UNSUPPORTED);
+	return -1;
+#endif
 }
 
-void _get_row_data(dbi_result_t *result, dbi_row_t *row, unsigned long long rowidx) {
-	unsigned int curfield = 0;
-	char *raw = NULL;
-	size_t strsize = 0;
-	unsigned int sizeattrib;
-	dbi_data_t *data;
-	unsigned char *temp = NULL;
-	size_t unquoted_length;
+int dbd_pgsql_send_query(dbi_conn Conn, const char *statement) {
+	/* dispatches a query without waiting for the result. Use
+	 * dbd_pgsql_consume_input() to poll for the result and
+	 * dbd_pgsql_get_result() to retrieve it.
+	 * returns 0 on success, -1 on error */
+	dbi_conn_t *conn = Conn;
 
+	if (!PQsendQuery((PGconn *)conn->connection, statement)) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return -1;
+	}
+	return 0;
+}
 
-	while (curfield < result->numfields) {
-		raw = PQgetvalue((PGresult *)result->result_handle, rowidx, curfield);
-		data = &row->field_values[curfield];
+int dbd_pgsql_send_query_params(dbi_conn Conn, const char *statement, int n_params, const char * const *param_values) {
+	/* same as above, but passes the parameters $1...$n separately from
+	 * the command string. All parameters are sent in text format, NULL
+	 * pointers are sent as SQL NULL.
+	 * returns 0 on success, -1 on error */
+	dbi_conn_t *conn = Conn;
 
-		row->field_sizes[curfield] = 0;
-		/* will be set to strlen later on for strings */
-		
+	if (!PQsendQueryParams((PGconn *)conn->connection, statement, n_params, NULL, param_values, NULL, NULL, 0)) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return -1;
+	}
+	return 0;
+}
+
+int dbd_pgsql_consume_input(dbi_conn Conn) {
+	/* reads whatever the server has sent so far. Call this when the
+	 * socket returned by dbi_conn_get_socket() becomes readable.
+	 * returns 1 if the query is still in progress, 0 if the result can be
+	 * retrieved without blocking, -1 on error */
+	dbi_conn_t *conn = Conn;
+	PGconn *pgconn = (PGconn *)conn->connection;
+
+	if (!PQconsumeInput(pgconn)) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return -1;
+	}
+	return PQisBusy(pgconn) ? 1 : 0;
+}
+
+dbi_result dbd_pgsql_get_result(dbi_conn Conn) {
+	/* collects the result of a query dispatched by dbd_pgsql_send_query()
+	 * or dbd_pgsql_send_query_params(). Blocks if the query has not yet
+	 * finished. If the query string contained several commands, only the
+	 * result of the last one is returned.
+	 * returns a result or NULL on error */
+	dbi_conn_t *conn = Conn;
+	PGconn *pgconn = (PGconn *)conn->connection;
+	PGresult *res;
+	PGresult *lastres = NULL;
+	int resstatus;
+
+	/* libpq wants us to read until it returns NULL, otherwise the
+	   connection won't accept new commands */
+	while ((res = PQgetResult(pgconn)) != NULL) {
+		PQclear(lastres);
+		lastres = res;
+	}
+
+	if (lastres) resstatus = PQresultStatus(lastres);
+	if (!lastres || ((resstatus != PGRES_COMMAND_OK) && (resstatus != PGRES_TUPLES_OK) && (resstatus != PGRES_COPY_OUT) && (resstatus != PGRES_COPY_IN))) {
+		PQclear(lastres);
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return NULL;
+	}
+
+	return (dbi_result)_create_result(conn, lastres);
+}
+
+int dbd_pgsql_prepare(dbi_conn Conn, const char *stmt_name, const char *statement, int n_params) {
+	/* creates the prepared statement stmt_name with the parameters $1...$n.
+	 * The field descriptions of its results are looked up once and reused
+	 * by every dbd_pgsql_execute_prepared().
+	 * returns 0 on success, -1 on error */
+	dbi_conn_t *conn = Conn;
+	PGconn *pgconn = (PGconn *)conn->connection;
+	pgsql_conn_data_t *conn_data = _get_conn_data(pgconn);
+	pgsql_stmt_t *stmt;
+	PGresult *res;
+
+	res = PQprepare(pgconn, stmt_name, statement, n_params, NULL);
+	if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+		PQclear(res);
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return -1;
+	}
+	PQclear(res);
+
+	if (conn_data) {
+		/* forget a previous statement of the same name. If the
+		   description fails, the results are described one by one */
+		_free_stmt(_find_stmt(conn_data, stmt_name, 1));
+		if ((stmt = _describe_stmt(conn, stmt_name)) != NULL) {
+			stmt->next = conn_data->stmts;
+			conn_data->stmts = stmt;
+		}
+	}
+	return 0;
+}
+
+dbi_result dbd_pgsql_execute_prepared(dbi_conn Conn, const char *stmt_name, int n_params, const char * const *param_values) {
+	/* executes a statement created by dbd_pgsql_prepare(). All parameters
+	 * are sent in text format, NULL pointers are sent as SQL NULL.
+	 * returns a result or NULL on error */
+	dbi_conn_t *conn = Conn;
+	PGconn *pgconn = (PGconn *)conn->connection;
+	pgsql_conn_data_t *conn_data = _get_conn_data(pgconn);
+	pgsql_stmt_t *stmt = NULL;
+	dbi_result_t *result;
+	PGresult *res;
+	int resstatus;
+	unsigned int idx;
+
+	res = PQexecPrepared(pgconn, stmt_name, n_params, param_values, NULL, NULL, 0);
+	if (res) resstatus = PQresultStatus(res);
+	if (!res || ((resstatus != PGRES_COMMAND_OK) && (resstatus != PGRES_TUPLES_OK))) {
+		PQclear(res);
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return NULL;
+	}
+
+	if (conn_data) {
+		stmt = _find_stmt(conn_data, stmt_name, 0);
+	}
+	if (!stmt || stmt->numfields != (unsigned int)PQnfields(res)) {
+		return (dbi_result)_create_result(conn, res);
+	}
+
+	conn_data->last_activity = time(NULL);
+	result = _dbd_result_create(conn, (void *)res, (unsigned long long)PQntuples(res), (unsigned long long)atoll(PQcmdTuples(res)));
+	_dbd_result_set_numfields(result, stmt->numfields);
+	for (idx = 0; idx < stmt->numfields; idx++) {
+		_dbd_result_add_field(result, idx, stmt->field_names[idx], stmt->field_types[idx], stmt->field_attribs[idx]);
+	}
+	return (dbi_result)result;
+}
+
+int dbd_pgsql_deallocate(dbi_conn Conn, const char *stmt_name) {
+	/* removes a statement created by dbd_pgsql_prepare().
+	 * returns 0 on success, -1 on error */
+	dbi_conn_t *conn = Conn;
+	PGconn *pgconn = (PGconn *)conn->connection;
+	pgsql_conn_data_t *conn_data = _get_conn_data(pgconn);
+	PGresult *res;
+	char *sql_cmd;
+	char *quoted;
+	const char *src;
+	char *dest;
+
+	if (conn_data) {
+		_free_stmt(_find_stmt(conn_data, stmt_name, 1));
+	}
+
+	/* the name is an identifier, double any double quotes */
+	if ((quoted = malloc(2*strlen(stmt_name)+1)) == NULL) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		return -1;
+	}
+	for (src = stmt_name, dest = quoted; *src; src++) {
+		if (*src == '"') {
+			*dest++ = '"';
+		}
+		*dest++ = *src;
+	}
+	*dest = '\0';
+
+	asprintf(&sql_cmd, "DEALLOCATE \"%s\"", quoted);
+	free(quoted);
+	if (!sql_cmd) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		return -1;
+	}
+	res = PQexec(pgconn, sql_cmd);
+	free(sql_cmd);
+	if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+		PQclear(res);
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return -1;
+	}
+	PQclear(res);
+	return 0;
+}
+
+int dbd_pgsql_get_notifies(dbi_conn Conn, PGnotify **notifies, int max_notifies, int timeout_ms) {
+	/* collects up to max_notifies notifications received for channels
+	 * this connection LISTENs on. If none are pending, waits up to
+	 * timeout_ms milliseconds for one to arrive; 0 returns immediately,
+	 * a negative timeout waits forever. The caller frees each
+	 * notification with PQfreemem().
+	 * returns the number of notifications, or -1 on error */
+	dbi_conn_t *conn = Conn;
+	PGconn *pgconn = (PGconn *)conn->connection;
+	PGnotify *notify;
+	struct timeval start;
+	struct timeval now;
+	int n_notifies = 0;
+	int wait_ms = timeout_ms;
+	int ready;
+
+	if (max_notifies <= 0) {
+		return 0;
+	}
+
+	gettimeofday(&start, NULL);
+
+	for (;;) {
+		/* pick up whatever arrived since the last call without
+		   touching the socket if possible */
+		if (!PQconsumeInput(pgconn)) {
+			_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+			return -1;
+		}
+		while (n_notifies < max_notifies && (notify = PQnotifies(pgconn)) != NULL) {
+			notifies[n_notifies++] = notify;
+		}
+		if (n_notifies || !timeout_ms) {
+			return n_notifies;
+		}
+
+		if (timeout_ms > 0) {
+			gettimeofday(&now, NULL);
+			wait_ms = timeout_ms - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000);
+			if (wait_ms <= 0) {
+				return 0;
+			}
+		}
+
+		/* other server messages wake us up too, so loop until a
+		   notification arrives or the time is up */
+		if ((ready = _wait_socket(pgconn, 1, 0, wait_ms)) < 0) {
+			_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+			return -1;
+		}
+		if (!ready) {
+			return 0;
+		}
+	}
+}
+
+/* PER-CONNECTION DRIVER DATA */
+
+int _is_driver_option(const char *optname) {
+	int i;
+	size_t len;
+
+	for (i = 0; driver_options[i]; i++) {
+		len = strlen(driver_options[i]);
+		if (driver_options[i][len-1] == '*') {
+			if (!strncmp(driver_options[i], optname, len-1)) {
+				return 1;
+			}
+		}
+		else if (!strcmp(driver_options[i], optname)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+pgsql_conn_data_t *_get_conn_data(PGconn *pgconn) {
+	/* returns the driver data of the connection, or NULL if libpq is
+	   too old to support event procedures */
+#ifdef HAVE_PQREGISTEREVENTPROC
+	if (pgconn) {
+		return (pgsql_conn_data_t *)PQinstanceData(pgconn, _event_proc);
+	}
+#endif
+	return NULL;
+}
+
+void _free_conn_data(pgsql_conn_data_t *conn_data) {
+	pgsql_seq_block_t *seq_block;
+	pgsql_cursor_t *cursor;
+	pgsql_stmt_t *stmt;
+
+	if (!conn_data) {
+		return;
+	}
+	free(conn_data->types);
+	_free_idle_conns(conn_data->idle_conns);
+	while ((cursor = conn_data->cursors) != NULL) {
+		/* the results still refer to the pages, just forget the cursors */
+		conn_data->cursors = cursor->next;
+		free(cursor);
+	}
+	while ((stmt = conn_data->stmts) != NULL) {
+		conn_data->stmts = stmt->next;
+		_free_stmt(stmt);
+	}
+	while ((seq_block = conn_data->seq_blocks) != NULL) {
+		conn_data->seq_blocks = seq_block->next_block;
+		free(seq_block->name);
+		free(seq_block->values);
+		free(seq_block);
+	}
+	free(conn_data);
+}
+
+#ifdef HAVE_PQREGISTEREVENTPROC
+int _event_proc(PGEventId evtId, void *evtInfo, void *passThrough) {
+	pgsql_conn_data_t *conn_data;
+	pgsql_cursor_t *cursor;
+
+	switch (evtId) {
+		case PGEVT_REGISTER:
+			if ((conn_data = calloc(1, sizeof(pgsql_conn_data_t))) == NULL) {
+				return 0;
+			}
+			PQsetInstanceData(((PGEventRegister *)evtInfo)->conn, _event_proc, conn_data);
+			break;
+		case PGEVT_CONNDESTROY:
+			_free_conn_data(PQinstanceData(((PGEventConnDestroy *)evtInfo)->conn, _event_proc));
+			break;
+		case PGEVT_CONNRESET:
+			/* the new session has none of the cursors */
+			if ((conn_data = PQinstanceData(((PGEventConnReset *)evtInfo)->conn, _event_proc)) != NULL) {
+				for (cursor = conn_data->cursors; cursor; cursor = cursor->next) {
+					cursor->pgconn = NULL;
+				}
+			}
+			break;
+		default:
+			break;
+	}
+	return 1;
+}
+#endif
+
+int _wait_socket(PGconn *pgconn, int for_read, int for_write, int timeout_ms) {
+	/* waits until the connection socket is ready for reading and/or
+	   writing. A negative timeout waits forever.
+	   returns >0 if the socket is ready, 0 on timeout, -1 on error */
+	int sock = PQsocket(pgconn);
+#ifdef HAVE_POLL_H
+	struct pollfd pfd;
+
+	if (sock < 0) {
+		return -1;
+	}
+
+	pfd.fd = sock;
+	pfd.events = (for_read ? POLLIN : 0) | (for_write ? POLLOUT : 0);
+	pfd.revents = 0;
+	return poll(&pfd, 1, timeout_ms);
+#else
+	fd_set readfds;
+	fd_set writefds;
+	struct timeval tv;
+
+	if (sock < 0) {
+		return -1;
+	}
+
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	if (for_read) FD_SET(sock, &readfds);
+	if (for_write) FD_SET(sock, &writefds);
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	return select(sock+1, &readfds, &writefds, NULL, (timeout_ms < 0) ? NULL : &tv);
+#endif
+}
+
+int _reset_conn(dbi_conn_t *conn) {
+	/* reconnects without blocking for longer than the "timeout" option
+	   allows, or PGSQL_RESET_TIMEOUT seconds if it is not set. PQreset()
+	   would wait for libpq's own connect timeout, which is unlimited by
+	   default.
+	   returns 1 if the connection is usable again, 0 if not */
+	PGconn *pgconn = (PGconn *)conn->connection;
+	pgsql_conn_data_t *conn_data = _get_conn_data(pgconn);
+	PostgresPollingStatusType status = PGRES_POLLING_WRITING;
+	int timeout = dbi_conn_get_option_numeric(conn, "timeout");
+	int wait_ms;
+	long long elapsed_usecs = 0;
+	struct timeval start;
+	struct timeval now;
+
+	if (timeout <= 0) {
+		timeout = PGSQL_RESET_TIMEOUT;
+	}
+
+	gettimeofday(&start, NULL);
+
+	if (!PQresetStart(pgconn)) {
+		status = PGRES_POLLING_FAILED;
+	}
+
+	while (status == PGRES_POLLING_READING || status == PGRES_POLLING_WRITING) {
+		gettimeofday(&now, NULL);
+		elapsed_usecs = (long long)(now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+		wait_ms = timeout * 1000 - (int)(elapsed_usecs / 1000);
+		if (wait_ms <= 0) {
+			status = PGRES_POLLING_FAILED;
+			break;
+		}
+
+		if (_wait_socket(pgconn, status == PGRES_POLLING_READING, status == PGRES_POLLING_WRITING, wait_ms) <= 0) {
+			status = PGRES_POLLING_FAILED;
+			break;
+		}
+		status = PQresetPoll(pgconn);
+	}
+
+	if (conn_data) {
+		gettimeofday(&now, NULL);
+		elapsed_usecs = (long long)(now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+		conn_data->resets++;
+		conn_data->reset_usecs += (unsigned long long)elapsed_usecs;
+		if (status == PGRES_POLLING_OK) {
+			conn_data->last_activity = time(NULL);
+		}
+		else {
+			conn_data->failed_resets++;
+		}
+	}
+
+	return (status == PGRES_POLLING_OK && PQstatus(pgconn) == CONNECTION_OK) ? 1 : 0;
+}
+
+/* SEQUENCE BLOCKS */
+
+int _get_seq_block_size(dbi_conn_t *conn, const char *sequence) {
+	/* the option pgsql_seq_block_<sequence> takes precedence over
+	   pgsql_seq_block. Values below 2 disable the allocator, so use 1
+	   to exempt a particular sequence */
+	char *optname;
+	int block_size = -1;
+
+	asprintf(&optname, "pgsql_seq_block_%s", sequence);
+	if (optname) {
+		block_size = dbi_conn_get_option_numeric(conn, optname);
+		free(optname);
+	}
+	if (block_size <= 0) {
+		block_size = dbi_conn_get_option_numeric(conn, "pgsql_seq_block");
+	}
+	return block_size;
+}
+
+pgsql_seq_block_t *_find_seq_block(pgsql_conn_data_t *conn_data, const char *sequence, int create) {
+	pgsql_seq_block_t *seq_block;
+
+	for (seq_block = conn_data->seq_blocks; seq_block; seq_block = seq_block->next_block) {
+		if (!strcmp(seq_block->name, sequence)) {
+			return seq_block;
+		}
+	}
+
+	if (!create || (seq_block = calloc(1, sizeof(pgsql_seq_block_t))) == NULL) {
+		return NULL;
+	}
+	if ((seq_block->name = strdup(sequence)) == NULL) {
+		free(seq_block);
+		return NULL;
+	}
+	seq_block->next_block = conn_data->seq_blocks;
+	conn_data->seq_blocks = seq_block;
+	return seq_block;
+}
+
+int _fill_seq_block(dbi_conn_t *conn, pgsql_seq_block_t *seq_block, int block_size) {
+	/* fetches the next block_size values of the sequence in one query.
+	   Concurrent sessions may draw from the same sequence, so the values
+	   need not be consecutive.
+	   returns 0 on success, -1 on error */
+	char *sql_cmd;
+	dbi_result_t *result;
+	PGresult *res;
+	unsigned long long *values;
+	int rowidx;
+
+	if (block_size > seq_block->values_size) {
+		if ((values = realloc(seq_block->values, block_size * sizeof(unsigned long long))) == NULL) {
+			return -1;
+		}
+		seq_block->values = values;
+		seq_block->values_size = block_size;
+	}
+
+	asprintf(&sql_cmd, "SELECT nextval('%s') FROM generate_series(1,%d)", seq_block->name, block_size);
+	if (!sql_cmd) return -1;
+	result = _exec_query(conn, sql_cmd);
+	free(sql_cmd);
+
+	if (!result) {
+		return -1;
+	}
+
+	res = (PGresult *)result->result_handle;
+	seq_block->n_values = 0;
+	seq_block->next = 0;
+	for (rowidx = 0; rowidx < PQntuples(res) && rowidx < block_size; rowidx++) {
+		seq_block->values[seq_block->n_values++] = (unsigned long long)atoll(PQgetvalue(res, rowidx, 0));
+	}
+	dbi_result_free((dbi_result)result);
+
+	return seq_block->n_values ? 0 : -1;
+}
+
+/* IDLE CONNECTIONS */
+
+void _free_idle_conns(pgsql_idle_conn_t *idle_conns) {
+	pgsql_idle_conn_t *idle_conn;
+
+	while ((idle_conn = idle_conns) != NULL) {
+		idle_conns = idle_conn->next;
+		PQfinish(idle_conn->pgconn);
+		free(idle_conn->dbname);
+		free(idle_conn);
+	}
+}
+
+PGconn *_take_idle_conn(pgsql_idle_conn_t **idle_conns, const char *db, int timeout) {
+	/* removes the connection to db from the list and returns it if it is
+	   still usable. Connections idle for more than timeout seconds are
+	   closed on the way */
+	pgsql_idle_conn_t **link = idle_conns;
+	pgsql_idle_conn_t *idle_conn;
+	PGconn *pgconn = NULL;
+	time_t now = time(NULL);
+
+	while ((idle_conn = *link) != NULL) {
+		if (timeout > 0 && now - idle_conn->since > timeout) {
+			*link = idle_conn->next;
+		}
+		else if (!pgconn && !strcmp(idle_conn->dbname, db)) {
+			*link = idle_conn->next;
+			/* the server may have closed the connection meanwhile */
+			if (PQstatus(idle_conn->pgconn) == CONNECTION_OK
+			    && (_wait_socket(idle_conn->pgconn, 1, 0, 0) <= 0 || PQconsumeInput(idle_conn->pgconn))) {
+				pgconn = idle_conn->pgconn;
+				idle_conn->pgconn = NULL;
+			}
+		}
+		else {
+			link = &idle_conn->next;
+			continue;
+		}
+
+		if (idle_conn->pgconn) {
+			PQfinish(idle_conn->pgconn);
+		}
+		free(idle_conn->dbname);
+		free(idle_conn);
+	}
+
+	return pgconn;
+}
+
+pgsql_idle_conn_t *_park_idle_conn(pgsql_idle_conn_t *idle_conns, PGconn *pgconn, const char *db, int capacity) {
+	/* adds the connection to the front of the list and trims the list to
+	   capacity entries. Connections inside a transaction are closed, as
+	   are those which we can't put into the list.
+	   returns the new list */
+	pgsql_idle_conn_t *idle_conn;
+	pgsql_idle_conn_t **link;
+	int count;
+
+	if (!db || PQstatus(pgconn) != CONNECTION_OK || PQtransactionStatus(pgconn) != PQTRANS_IDLE
+	    || (idle_conn = malloc(sizeof(pgsql_idle_conn_t))) == NULL) {
+		PQfinish(pgconn);
+		return idle_conns;
+	}
+
+	if ((idle_conn->dbname = strdup(db)) == NULL) {
+		free(idle_conn);
+		PQfinish(pgconn);
+		return idle_conns;
+	}
+	idle_conn->pgconn = pgconn;
+	idle_conn->since = time(NULL);
+	idle_conn->next = idle_conns;
+
+	for (link = &idle_conn, count = 0; *link && count < capacity; link = &(*link)->next, count++);
+	_free_idle_conns(*link);
+	*link = NULL;
+
+	return idle_conn;
+}
+
+/* PREPARED STATEMENT CACHE */
+
+pgsql_stmt_t *_find_stmt(pgsql_conn_data_t *conn_data, const char *stmt_name, int unlink) {
+	/* returns the cached description of a prepared statement, or NULL if
+	   there is none. If unlink is nonzero, it is removed from the cache */
+	pgsql_stmt_t **link;
+	pgsql_stmt_t *stmt;
+
+	for (link = &conn_data->stmts; (stmt = *link) != NULL; link = &stmt->next) {
+		if (!strcmp(stmt->name, stmt_name)) {
+			if (unlink) {
+				*link = stmt->next;
+			}
+			return stmt;
+		}
+	}
+	return NULL;
+}
+
+void _free_stmt(pgsql_stmt_t *stmt) {
+	unsigned int idx;
+
+	if (!stmt) {
+		return;
+	}
+	if (stmt->field_names) {
+		for (idx = 0; idx < stmt->numfields; idx++) {
+			free(stmt->field_names[idx]);
+		}
+	}
+	free(stmt->name);
+	free(stmt->field_names);
+	free(stmt->field_types);
+	free(stmt->field_attribs);
+	free(stmt);
+}
+
+pgsql_stmt_t *_describe_stmt(dbi_conn_t *conn, const char *stmt_name) {
+	/* looks up the field descriptions of a prepared statement.
+	   returns the description, or NULL on error */
+#ifdef HAVE_PQREGISTEREVENTPROC
+	/* PQdescribePrepared() is older than the event procedures which we
+	   need to cache the description anyway */
+	PGresult *res;
+	pgsql_stmt_t *stmt;
+	unsigned int idx;
+	int extended = (dbi_conn_get_option_numeric(conn, "pgsql_extended_types") > 0);
+
+	res = PQdescribePrepared((PGconn *)conn->connection, stmt_name);
+	if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+		PQclear(res);
+		return NULL;
+	}
+
+	if ((stmt = calloc(1, sizeof(pgsql_stmt_t))) == NULL
+	    || (stmt->name = strdup(stmt_name)) == NULL) {
+		free(stmt);
+		PQclear(res);
+		return NULL;
+	}
+	stmt->numfields = (unsigned int)PQnfields(res);
+	if (stmt->numfields
+	    && ((stmt->field_names = calloc(stmt->numfields, sizeof(char *))) == NULL
+		|| (stmt->field_types = malloc(stmt->numfields * sizeof(unsigned short))) == NULL
+		|| (stmt->field_attribs = malloc(stmt->numfields * sizeof(unsigned int))) == NULL)) {
+		_free_stmt(stmt);
+		PQclear(res);
+		return NULL;
+	}
+
+	for (idx = 0; idx < stmt->numfields; idx++) {
+		if ((stmt->field_names[idx] = strdup(PQfname(res, idx))) == NULL) {
+			_free_stmt(stmt);
+			PQclear(res);
+			return NULL;
+		}
+		_get_field_type(conn, res, idx, extended, &stmt->field_types[idx], &stmt->field_attribs[idx]);
+	}
+
+	PQclear(res);
+	return stmt;
+#else
+	return NULL;
+#endif
+}
+
+/* CURSORS */
+
+int _is_select(const char *statement) {
+	/* returns 1 if the statement is a single SELECT which can be run
+	   through a cursor, 0 otherwise. We don't bother to skip string
+	   literals and identifiers: if one of them looks like a keyword
+	   which rules out a cursor, the query just runs the usual way */
+	static const char *locks[] = {"UPDATE", "SHARE", "NO", "KEY", NULL};
+	const char *pos;
+	int i;
+
+	while (isspace((unsigned char)*statement) || *statement == '(') {
+		statement++;
+	}
+	if (!_word_at(statement, "SELECT")) {
+		return 0;
+	}
+	/* DECLARE takes exactly one statement */
+	if (strchr(statement, ';') != NULL) {
+		return 0;
+	}
+	/* SELECT INTO creates a table, which a cursor can't do */
+	if (_find_word(statement, "INTO")) {
+		return 0;
+	}
+	/* row locking clauses are not allowed in scrollable cursors */
+	for (pos = statement; (pos = _find_word(pos, "FOR")) != NULL;) {
+		while (isspace((unsigned char)*pos)) {
+			pos++;
+		}
+		for (i = 0; locks[i]; i++) {
+			if (_word_at(pos, locks[i])) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+size_t _word_at(const char *pos, const char *word) {
+	/* returns the length of word if pos starts with it, ignoring case,
+	   and the word ends there. returns 0 otherwise */
+	size_t len = strlen(word);
+
+	if (strncasecmp(pos, word, len)
+	    || isalnum((unsigned char)pos[len]) || pos[len] == '_' || pos[len] == '$') {
+		return 0;
+	}
+	return len;
+}
+
+const char *_find_word(const char *statement, const char *word) {
+	/* finds word as a whole word in the statement, ignoring case.
+	   returns a pointer behind the word, or NULL if it is not found */
+	const char *pos;
+	size_t len;
+
+	for (pos = statement; *pos; pos++) {
+		if (pos > statement
+		    && (isalnum((unsigned char)pos[-1]) || pos[-1] == '_' || pos[-1] == '$')) {
+			continue;
+		}
+		if ((len = _word_at(pos, word)) != 0) {
+			return pos + len;
+		}
+	}
+	return NULL;
+}
+
+dbi_result_t *_cursor_query(dbi_conn_t *conn, pgsql_conn_data_t *conn_data, const char *statement, int page_size) {
+	/* runs the statement through a scrollable cursor and fetches its first
+	   page. The cursor is declared WITH HOLD so that it outlives the
+	   transaction it was declared in, be it the implicit one of the
+	   DECLARE or one of the application.
+	   returns the result, or NULL on error */
+	PGconn *pgconn = (PGconn *)conn->connection;
+	pgsql_cursor_t *cursor;
+	dbi_result_t *result;
+	PGresult *res;
+	PGresult *page;
+	char *sql_cmd;
+	unsigned long long numrows;
+
+	if ((cursor = calloc(1, sizeof(pgsql_cursor_t))) == NULL) {
+		return NULL;
+	}
+	cursor->pgconn = pgconn;
+	cursor->page_size = page_size;
+	snprintf(cursor->name, sizeof(cursor->name), "dbd_pgsql_cursor_%lu", ++conn_data->cursor_serial);
+
+	asprintf(&sql_cmd, "DECLARE %s SCROLL CURSOR WITH HOLD FOR %s", cursor->name, statement);
+	if (!sql_cmd) {
+		free(cursor);
+		return NULL;
+	}
+	res = PQexec(pgconn, sql_cmd);
+	free(sql_cmd);
+	if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+		PQclear(res);
+		free(cursor);
+		return NULL;
+	}
+	PQclear(res);
+
+	/* the first page also provides the field descriptions */
+	if ((page = _fetch_page(cursor, 0, 1)) == NULL) {
+		free(cursor);
+		return NULL;
+	}
+	conn_data->last_activity = time(NULL);
+	numrows = (unsigned long long)PQntuples(page);
+
+	if (numrows == (unsigned long long)page_size) {
+		/* libdbi needs to know the number of rows in advance. The
+		   cursor stays at the end, so the first page is not read
+		   twice, which would call volatile functions again */
+		asprintf(&sql_cmd, "MOVE FORWARD ALL IN %s", cursor->name);
+		res = sql_cmd ? PQexec(pgconn, sql_cmd) : NULL;
+		free(sql_cmd);
+		if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+			PQclear(res);
+			PQclear(page);
+			free(cursor);
+			return NULL;
+		}
+		numrows += (unsigned long long)atoll(PQcmdTuples(res));
+		PQclear(res);
+		cursor->position = numrows;
+	}
+
+	if (numrows <= (unsigned long long)page_size) {
+		/* the whole result fit into the first page, so this is
+		   an ordinary result */
+		_close_cursor(cursor, 1);
+		free(cursor);
+		return _create_result(conn, page);
+	}
+
+	result = _dbd_result_create(conn, (void *)page, numrows, 0);
+	cursor->result = result;
+	_dbd_result_set_numfields(result, (unsigned int)PQnfields((PGresult *)result->result_handle));
+	_get_field_info(result);
+
+	cursor->next = conn_data->cursors;
+	conn_data->cursors = cursor;
+
+	return result;
+}
+
+pgsql_cursor_t *_find_cursor(dbi_result_t *result, int unlink) {
+	/* returns the cursor of a paged result, or NULL if the result
+	   is not paged. If unlink is nonzero, the cursor is removed from
+	   the list of its connection */
+	pgsql_conn_data_t *conn_data = _get_conn_data((PGconn *)result->conn->connection);
+	pgsql_cursor_t **link;
+	pgsql_cursor_t *cursor;
+
+	if (!conn_data) {
+		return NULL;
+	}
+	for (link = &conn_data->cursors; (cursor = *link) != NULL; link = &cursor->next) {
+		if (cursor->result == result) {
+			if (unlink) {
+				*link = cursor->next;
+			}
+			return cursor;
+		}
+	}
+	return NULL;
+}
+
+int _cursor_usable(pgsql_cursor_t *cursor) {
+	/* a failing statement on a cursor which no longer exists would
+	   abort the transaction of the application. The cursor is gone if
+	   the transaction which declared it was rolled back, or if the
+	   application closed it. Outside of a transaction a failing
+	   statement does no harm, inside of one we check first.
+	   returns 1 if statements on the cursor are safe, 0 if not */
+	PGresult *res;
+	char *sql_cmd;
+	int exists = 0;
+
+	switch (PQtransactionStatus(cursor->pgconn)) {
+		case PQTRANS_IDLE:
+			return 1;
+		case PQTRANS_INTRANS:
+			asprintf(&sql_cmd, "SELECT 1 FROM pg_cursors WHERE name = '%s'", cursor->name);
+			res = sql_cmd ? PQexec(cursor->pgconn, sql_cmd) : NULL;
+			free(sql_cmd);
+			exists = (res && PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0);
+			PQclear(res);
+			return exists;
+		default:
+			/* busy, or the transaction failed already */
+			return 0;
+	}
+}
+
+void _close_cursor(pgsql_cursor_t *cursor, int known_open) {
+	/* closes the cursor on the server if that is safe. known_open says
+	   that the cursor was just declared, so there is no need to check */
+	char *sql_cmd;
+
+	if (known_open || _cursor_usable(cursor)) {
+		asprintf(&sql_cmd, "CLOSE %s", cursor->name);
+		if (sql_cmd) {
+			PQclear(PQexec(cursor->pgconn, sql_cmd));
+			free(sql_cmd);
+		}
+	}
+}
+
+pgsql_cursor_t *_detach_cursors(pgsql_conn_data_t *conn_data) {
+	/* takes the cursors off a connection which is about to be parked or
+	   closed. They are closed on the server, and the results keep only
+	   the page they have.
+	   returns the list of cursors */
+	pgsql_cursor_t *cursors;
+	pgsql_cursor_t *cursor;
+
+	if (!conn_data) {
+		return NULL;
+	}
+	cursors = conn_data->cursors;
+	conn_data->cursors = NULL;
+	for (cursor = cursors; cursor; cursor = cursor->next) {
+		if (cursor->pgconn) {
+			_close_cursor(cursor, 0);
+			cursor->pgconn = NULL;
+		}
+	}
+	return cursors;
+}
+
+PGresult *_fetch_page(pgsql_cursor_t *cursor, unsigned long long first_row, int known_open) {
+	/* fetches the page of rows starting at first_row. known_open says
+	   that the cursor was just declared, see _cursor_usable().
+	   returns the page, or NULL on error */
+	PGresult *res;
+	char *sql_cmd;
+
+	if (!cursor->pgconn || (!known_open && !_cursor_usable(cursor))) {
+		return NULL;
+	}
+
+	if (cursor->position != first_row) {
+		asprintf(&sql_cmd, "MOVE ABSOLUTE %llu IN %s", first_row, cursor->name);
+		res = sql_cmd ? PQexec(cursor->pgconn, sql_cmd) : NULL;
+		free(sql_cmd);
+		if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+			PQclear(res);
+			return NULL;
+		}
+		PQclear(res);
+		cursor->position = first_row;
+	}
+
+	asprintf(&sql_cmd, "FETCH FORWARD %d FROM %s", cursor->page_size, cursor->name);
+	res = sql_cmd ? PQexec(cursor->pgconn, sql_cmd) : NULL;
+	free(sql_cmd);
+	if (!res || PQresultStatus(res) != PGRES_TUPLES_OK) {
+		PQclear(res);
+		return NULL;
+	}
+	cursor->first_row = first_row;
+	cursor->position = first_row + PQntuples(res);
+	return res;
+}
+
+/* LARGE OBJECTS */
+
+int _lo_begin(PGconn *pgconn) {
+	/* large object descriptors are only valid within a transaction.
+	   Start one unless the caller has done so already.
+	   returns 1 if we started a transaction, 0 if not, -1 on error */
+	PGresult *res;
+	int retval = 0;
+
+	if (PQtransactionStatus(pgconn) != PQTRANS_IDLE) {
+		return 0;
+	}
+
+	res = PQexec(pgconn, "BEGIN");
+	retval = (res && PQresultStatus(res) == PGRES_COMMAND_OK) ? 1 : -1;
+	PQclear(res);
+	return retval;
+}
+
+int _lo_end(PGconn *pgconn, int started, int success) {
+	/* ends the transaction started by _lo_begin(), if any.
+	   returns 0 on success, -1 on error */
+	PGresult *res;
+	int retval;
+
+	if (!started) {
+		return 0;
+	}
+
+	res = PQexec(pgconn, success ? "COMMIT" : "ROLLBACK");
+	retval = (res && PQresultStatus(res) == PGRES_COMMAND_OK) ? 0 : -1;
+	PQclear(res);
+	return retval;
+}
+
+int _lo_seek(PGconn *pgconn, int fd, long long offset) {
+	/* returns a non-negative value on success, -1 on error */
+#ifdef HAVE_LO_LSEEK64
+	return (lo_lseek64(pgconn, fd, (pg_int64)offset, SEEK_SET) < 0) ? -1 : 0;
+#else
+	/* libpq before 9.3 can only address the first 2GB */
+	if (offset > 0x7fffffffLL) {
+		return -1;
+	}
+	return lo_lseek(pgconn, fd, (int)offset, SEEK_SET);
+#endif
+}
+
+/* USER-DEFINED TYPE CACHE */
+
+pgsql_type_t *_find_type(pgsql_conn_data_t *conn_data, unsigned int oid) {
+	size_t lo = 0;
+	size_t hi = conn_data->n_types;
+	size_t mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (conn_data->types[mid].oid == oid) {
+			return &conn_data->types[mid];
+		}
+		else if (conn_data->types[mid].oid < oid) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+int _add_type(pgsql_conn_data_t *conn_data, unsigned int oid, unsigned int basetype) {
+	/* inserts a type, keeping the cache sorted by oid */
+	pgsql_type_t *types;
+	size_t idx;
+
+	if (conn_data->n_types == conn_data->types_size) {
+		size_t new_size = conn_data->types_size ? 2 * conn_data->types_size : 32;
+
+		if ((types = realloc(conn_data->types, new_size * sizeof(pgsql_type_t))) == NULL) {
+			return -1;
+		}
+		conn_data->types = types;
+		conn_data->types_size = new_size;
+	}
+
+	idx = conn_data->n_types;
+	while (idx > 0 && conn_data->types[idx-1].oid > oid) {
+		conn_data->types[idx] = conn_data->types[idx-1];
+		idx--;
+	}
+	conn_data->types[idx].oid = oid;
+	conn_data->types[idx].basetype = basetype;
+	conn_data->n_types++;
+	return 0;
+}
+
+int _load_types(dbi_conn_t *conn, pgsql_conn_data_t *conn_data) {
+	/* reads all domains in one go and adds them to the cache. Types
+	   already known as non-domains stay in the cache. We bypass libdbi
+	   here as we are called while libdbi sets up the fields of another
+	   result.
+	   returns 0 on success, -1 if the domains could not be read */
+	PGconn *pgconn = (PGconn *)conn->connection;
+	PGresult *res;
+	pgsql_type_t *type;
+	unsigned int oid;
+	unsigned int basetype;
+	int rowidx;
+	int retval = 0;
+
+	/* we can't run a query while another one is in progress */
+	if (PQtransactionStatus(pgconn) == PQTRANS_ACTIVE) {
+		return -1;
+	}
+#ifdef HAVE_PQENTERPIPELINEMODE
+	if (PQpipelineStatus(pgconn) != PQ_PIPELINE_OFF) {
+		return -1;
+	}
+#endif
+
+	res = PQexec(pgconn, "SELECT oid, typbasetype FROM pg_catalog.pg_type WHERE typtype = 'd' ORDER BY oid");
+	if (!res || PQresultStatus(res) != PGRES_TUPLES_OK) {
+		PQclear(res);
+		return -1;
+	}
+
+	for (rowidx = 0; rowidx < PQntuples(res); rowidx++) {
+		oid = (unsigned int)atoll(PQgetvalue(res, rowidx, 0));
+		basetype = (unsigned int)atoll(PQgetvalue(res, rowidx, 1));
+		if ((type = _find_type(conn_data, oid)) != NULL) {
+			type->basetype = basetype;
+		}
+		else if (_add_type(conn_data, oid, basetype)) {
+			retval = -1;
+			break;
+		}
+	}
+	PQclear(res);
+	return retval;
+}
+
+unsigned int _resolve_domain(dbi_conn_t *conn, unsigned int oid) {
+	/* returns the built-in type a domain is ultimately based on. Other
+	   types are returned unchanged. The cache is filled on the first
+	   user-defined type we come across and refreshed whenever we see a
+	   type we don't know yet. Types which turn out not to be domains
+	   are remembered as such, so each type costs at most one successful
+	   lookup */
+	pgsql_conn_data_t *conn_data = _get_conn_data((PGconn *)conn->connection);
+	pgsql_type_t *type;
+	int depth;
+
+	if (!conn_data) {
+		return oid;
+	}
+
+	for (depth = 0; depth < PG_MAX_DOMAIN_DEPTH && oid >= PG_FIRST_NORMAL_OID; depth++) {
+		if ((type = _find_type(conn_data, oid)) == NULL) {
+			if (_load_types(conn, conn_data)) {
+				/* try again next time */
+				break;
+			}
+			if ((type = _find_type(conn_data, oid)) == NULL) {
+				_add_type(conn_data, oid, 0);
+				break;
+			}
+		}
+		if (!type->basetype) {
+			break;
+		}
+		oid = type->basetype;
+	}
+	return oid;
+}
+
+int dbd_pgsql_get_ping_stats(dbi_conn Conn, unsigned long *pings, unsigned long *resets, unsigned long *failed_resets, unsigned long long *reset_usecs) {
+	/* retrieves the number of dbi_conn_ping() calls, the number of
+	 * reconnection attempts and how many of them failed, and the total
+	 * time spent reconnecting in microseconds. NULL pointers are
+	 * skipped.
+	 * returns 0 on success, -1 if the statistics are not available */
+	dbi_conn_t *conn = Conn;
+	pgsql_conn_data_t *conn_data = _get_conn_data((PGconn *)conn->connection);
+
+	if (!conn_data) {
+		return -1;
+	}
+
+	if (pings) *pings = conn_data->pings;
+	if (resets) *resets = conn_data->resets;
+	if (failed_resets) *failed_resets = conn_data->failed_resets;
+	if (reset_usecs) *reset_usecs = conn_data->reset_usecs;
+	return 0;
+}
+
+long long dbd_pgsql_lo_read_stream(dbi_conn Conn, unsigned int lobj_oid, long long offset, dbd_pgsql_lo_write_func writer, void *user_arg) {
+	/* reads a large object starting at offset and passes it to writer
+	 * in chunks of pgsql_lo_chunk_size bytes, so memory use does not
+	 * depend on the object size.
+	 * returns the number of bytes passed to writer, or -1 on error */
+	dbi_conn_t *conn = Conn;
+	PGconn *pgconn = (PGconn *)conn->connection;
+	int chunk_size = dbi_conn_get_option_numeric(conn, "pgsql_lo_chunk_size");
+	long long total = 0;
+	char *buf;
+	int started;
+	int fd;
+	int len = 0;
+
+	if (chunk_size <= 0) {
+		chunk_size = PGSQL_LO_CHUNK_SIZE;
+	}
+
+	if ((buf = malloc(chunk_size)) == NULL) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		return -1;
+	}
+
+	if ((started = _lo_begin(pgconn)) < 0) {
+		free(buf);
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return -1;
+	}
+
+	if ((fd = lo_open(pgconn, (Oid)lobj_oid, INV_READ)) < 0) {
+		len = -1;
+	}
+	else {
+		if (offset && _lo_seek(pgconn, fd, offset) < 0) {
+			len = -1;
+		}
+		else {
+			while ((len = lo_read(pgconn, fd, buf, chunk_size)) > 0) {
+				total += len;
+				if (writer(buf, (size_t)len, user_arg)) {
+					break;
+				}
+			}
+		}
+		lo_close(pgconn, fd);
+	}
+	free(buf);
+
+	if (len < 0) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		_lo_end(pgconn, started, 0);
+		return -1;
+	}
+	if (_lo_end(pgconn, started, 1)) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return -1;
+	}
+	return total;
+}
+
+unsigned int dbd_pgsql_lo_write_stream(dbi_conn Conn, unsigned int lobj_oid, long long offset, dbd_pgsql_lo_read_func reader, void *user_arg) {
+	/* writes the data supplied by reader into a large object, starting
+	 * at offset. If lobj_oid is 0, a new large object is created.
+	 * returns the oid of the large object, or 0 on error */
+	dbi_conn_t *conn = Conn;
+	PGconn *pgconn = (PGconn *)conn->connection;
+	int chunk_size = dbi_conn_get_option_numeric(conn, "pgsql_lo_chunk_size");
+	char *buf;
+	int started;
+	int fd;
+	long len = 0;
+	int success = 0;
+
+	if (chunk_size <= 0) {
+		chunk_size = PGSQL_LO_CHUNK_SIZE;
+	}
+
+	if ((buf = malloc(chunk_size)) == NULL) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		return 0;
+	}
+
+	if ((started = _lo_begin(pgconn)) < 0) {
+		free(buf);
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return 0;
+	}
+
+	if (!lobj_oid) {
+		lobj_oid = (unsigned int)lo_creat(pgconn, INV_READ|INV_WRITE);
+	}
+
+	if (lobj_oid && (fd = lo_open(pgconn, (Oid)lobj_oid, INV_WRITE)) >= 0) {
+		if (!offset || _lo_seek(pgconn, fd, offset) >= 0) {
+			while ((len = reader(buf, (size_t)chunk_size, user_arg)) > 0) {
+				if (lo_write(pgconn, fd, buf, (size_t)len) != len) {
+					len = -1;
+					break;
+				}
+			}
+			success = (len == 0);
+		}
+		lo_close(pgconn, fd);
+	}
+	free(buf);
+
+	if (_lo_end(pgconn, started, success) || !success) {
+		_dbd_internal_error_handler(conn, NULL, DBI_ERROR_DBD);
+		return 0;
+	}
+	return lobj_oid;
+}
+
+int dbd_pgsql_connect_many(dbi_conn *Conns, int n_conns, int timeout) {
+	/* establishes the connections at the same time instead of one after
+	 * the other. This is a replacement for calling dbi_conn_connect() on
+	 * each of them. timeout limits the total time in seconds if positive.
+	 * returns the number of established connections. Use
+	 * dbi_conn_error() to find out why the others failed */
+	dbi_conn_t *conn;
+	PGconn **pgconns;
+	PostgresPollingStatusType *status;
+	char *conninfo;
+	const char *dbname;
+	int n_ok = 0;
+	int idx;
+
+	if ((pgconns = calloc(n_conns, sizeof(PGconn *))) == NULL
+	    || (status = calloc(n_conns, sizeof(PostgresPollingStatusType))) == NULL) {
+		free(pgconns);
+		return 0;
+	}
+
+	for (idx = 0; idx < n_conns; idx++) {
+		conn = Conns[idx];
+		conninfo = _build_conninfo(conn, dbi_conn_get_option(conn, "dbname"), NULL, NULL);
+		pgconns[idx] = PQconnectStart(conninfo ? conninfo : "");
+		if (conninfo) free(conninfo);
+	}
+
+	_poll_connects(pgconns, status, n_conns, timeout, 0);
+
+	for (idx = 0; idx < n_conns; idx++) {
+		conn = Conns[idx];
+		dbname = dbi_conn_get_option(conn, "dbname");
+		if (!pgconns[idx]) {
+			_dbd_internal_error_handler(conn, NULL, DBI_ERROR_NOMEM);
+		}
+		else if (status[idx] != PGRES_POLLING_OK && status[idx] != PGRES_POLLING_FAILED) {
+			/* still in progress */
+			PQfinish(pgconns[idx]);
+			_dbd_internal_error_handler(conn, "timeout expired", DBI_ERROR_NOCONN);
+		}
+		else if (!_finish_connect(conn, pgconns[idx], dbname)) {
+			n_ok++;
+		}
+	}
+
+	free(pgconns);
+	free(status);
+	return n_ok;
+}
+
+/* CORE POSTGRESQL DATA FETCHING STUFF */
+
+dbi_result_t *_create_result(dbi_conn_t *conn, PGresult *res) {
+	dbi_result_t *result;
+	pgsql_conn_data_t *conn_data = _get_conn_data((PGconn *)conn->connection);
+
+	/* the server just answered, remember that for dbd_ping() */
+	if (conn_data) {
+		conn_data->last_activity = time(NULL);
+	}
+
+	result = _dbd_result_create(conn, (void *)res, (unsigned long long)PQntuples(res), (unsigned long long)atoll(PQcmdTuples(res)));
+	_dbd_result_set_numfields(result, (unsigned int)PQnfields((PGresult *)result->result_handle));
+	_get_field_info(result);
+
+	return result;
+}
+
+void _translate_postgresql_type(unsigned int oid, int extended, unsigned short *type, unsigned int *attribs) {
+	/* if extended is nonzero, types which are otherwise returned as
+	   strings are translated to numeric types where possible */
+	unsigned int _type = 0;
+	unsigned int _attribs = 0;
+
+/* 	  fprintf(stderr, "oid went to %d\n", oid); */
+	switch (oid) {
+		case PG_TYPE_BOOL:
+			if (extended) {
+				_type = DBI_TYPE_INTEGER;
+				_attribs |= DBI_INTEGER_SIZE1;
+			}
+			else {
+				_type = DBI_TYPE_STRING;
+			}
+			break;
+		case PG_TYPE_NUMERIC:
+			if (extended) {
+				_type = DBI_TYPE_DECIMAL;
+				_attribs |= DBI_DECIMAL_SIZE8;
+			}
+			else {
+				_type = DBI_TYPE_STRING;
+			}
+			break;
+
+		case PG_TYPE_CHAR:
+			_type = DBI_TYPE_INTEGER;
+			_attribs |= DBI_INTEGER_SIZE1;
+			break;
+		case PG_TYPE_INT2:
+			_type = DBI_TYPE_INTEGER;
+			_attribs |= DBI_INTEGER_SIZE2;
+			break;
+		case PG_TYPE_INT4:
+			_type = DBI_TYPE_INTEGER;
+			_attribs |= DBI_INTEGER_SIZE4;
+			break;
+		case PG_TYPE_INT8:
+			_type = DBI_TYPE_INTEGER;
+			_attribs |= DBI_INTEGER_SIZE8;
+			break;
+		case PG_TYPE_OID:
+			_type = DBI_TYPE_INTEGER;
+			_attribs |= DBI_INTEGER_SIZE8;
+			_attribs |= DBI_INTEGER_UNSIGNED;
+			break;
+			
+		case PG_TYPE_FLOAT4:
+			_type = DBI_TYPE_DECIMAL;
+			_attribs |= DBI_DECIMAL_SIZE4;
+			break;
+		case PG_TYPE_FLOAT8:
+			_type = DBI_TYPE_DECIMAL;
+			_attribs |= DBI_DECIMAL_SIZE8;
+			break;
+
+        case PG_TYPE_DATE:
+	        _type = DBI_TYPE_DATETIME;
+            _attribs |= DBI_DATETIME_DATE;
+            break;
+        case PG_TYPE_TIME:
+        case PG_TYPE_TIMETZ:
+            _type = DBI_TYPE_DATETIME;
+            _attribs |= DBI_DATETIME_TIME;
+            break;
+        case PG_TYPE_TIMESTAMP:
+        case PG_TYPE_TIMESTAMPTZ:
+			_type = DBI_TYPE_DATETIME;
+			_attribs |= DBI_DATETIME_DATE;
+			_attribs |= DBI_DATETIME_TIME;
+			break;
+
+		case PG_TYPE_NAME:
+		case PG_TYPE_TEXT:
+		case PG_TYPE_CHAR2:
+		case PG_TYPE_CHAR4:
+		case PG_TYPE_CHAR8:
+		case PG_TYPE_BPCHAR:
+		case PG_TYPE_VARCHAR:
+			_type = DBI_TYPE_STRING;
+			break;
+
+		case PG_TYPE_BYTEA:
+			_type = DBI_TYPE_BINARY;
+			break;
+			
+		default:
+			_type = DBI_TYPE_STRING;
+			break;
+	}
+	
+	*type = _type;
+	*attribs = _attribs;
+}
+
+void _get_field_type(dbi_conn_t *conn, PGresult *res, unsigned int idx, int extended, unsigned short *type, unsigned int *attribs) {
+	unsigned int pgOID = PQftype(res, idx);
+
+	if (extended) {
+		pgOID = _resolve_domain(conn, pgOID);
+	}
+	_translate_postgresql_type(pgOID, extended, type, attribs);
+}
+
+void _get_field_info(dbi_result_t *result) {
+	unsigned int idx = 0;
+	char *fieldname;
+	unsigned short fieldtype;
+	unsigned int fieldattribs;
+	
+	int extended = (dbi_conn_get_option_numeric(result->conn, "pgsql_extended_types") > 0);
+
+	while (idx < result->numfields) {
+		fieldname = PQfname((PGresult *)result->result_handle, idx);
+		_get_field_type(result->conn, (PGresult *)result->result_handle, idx, extended, &fieldtype, &fieldattribs);
+		_dbd_result_add_field(result, idx, fieldname, fieldtype, fieldattribs);
+		idx++;
+	}
+}
+
+void _get_row_data(dbi_result_t *result, dbi_row_t *row, unsigned long long rowidx) {
+	unsigned int curfield = 0;
+	char *raw = NULL;
+	size_t strsize = 0;
+	unsigned int sizeattrib;
+	dbi_data_t *data;
+	unsigned char *temp = NULL;
+	size_t unquoted_length;
+	unsigned int oid;
+
+
+	while (curfield < result->numfields) {
+		raw = PQgetvalue((PGresult *)result->result_handle, rowidx, curfield);
+		data = &row->field_values[curfield];
+
+		row->field_sizes[curfield] = 0;
+		/* will be set to strlen later on for strings */
+		
 		if (PQgetisnull((PGresult *)result->result_handle, rowidx, curfield) == 1) {
 		        _set_field_flag( row, curfield, DBI_VALUE_NULL, 1);
 			curfield++;
@@ -723,6 +2644,15 @@ void _get_row_data(dbi_result_t *result, dbi_row_t *row, unsigned long long rowi
 			case DBI_TYPE_INTEGER:
 				switch (result->field_attribs[curfield] & DBI_INTEGER_SIZEMASK) {
 					case DBI_INTEGER_SIZE1:
+						/* with pgsql_extended_types, booleans come
+						   as 't' or 'f'. "char" columns don't */
+						oid = PQftype((PGresult *)result->result_handle, curfield);
+						if (oid != PG_TYPE_BOOL && oid != PG_TYPE_CHAR) {
+							oid = _resolve_domain(result->conn, oid);
+						}
+						if (oid == PG_TYPE_BOOL) {
+							data->d_char = (*raw == 't'); break;
+						}
 						data->d_char = (char) atol(raw); break;
 					case DBI_INTEGER_SIZE2:
 						data->d_short = (short) atol(raw); break;
@@ -746,11 +2676,31 @@ void _get_row_data(dbi_result_t *result, dbi_row_t *row, unsigned long long rowi
 				}
 				break;
 			case DBI_TYPE_STRING:
-			    strsize = (size_t)PQgetlength((PGresult *)result->result_handle, rowidx, curfield);
-				data->d_string = strdup(raw);
+				/* libpq knows the length already, so a plain copy
+				   including the terminating NULL byte saves the
+				   strlen() pass of strdup() */
+				strsize = (size_t)PQgetlength((PGresult *)result->result_handle, rowidx, curfield);
+				if ((data->d_string = malloc(strsize+1)) == NULL) {
+					break;
+				}
+				memcpy(data->d_string, raw, strsize+1);
 				row->field_sizes[curfield] = strsize;
 				break;
 			case DBI_TYPE_BINARY:	
+			  strsize = (size_t)PQgetlength((PGresult *)result->result_handle, rowidx, curfield);
+			  if (strsize >= 2 && raw[0] == '\\' && raw[1] == 'x' && !(strsize & 1)) {
+			    /* hex format (servers 9.0 and later), decode right
+			       into the final buffer */
+			    unquoted_length = (strsize - 2) / 2;
+			    if ((data->d_string = malloc(unquoted_length+1)) == NULL) {
+			      break;
+			    }
+			    _decode_hex(raw+2, strsize-2, (unsigned char *)data->d_string);
+			    data->d_string[unquoted_length] = '\0';
+			    row->field_sizes[curfield] = unquoted_length;
+			    break;
+			  }
+			  /* escape format, let libpq deal with it */
 			  temp = PQunescapeBytea((const unsigned char *)raw, &unquoted_length);
 			  if ((data->d_string = malloc(unquoted_length)) == NULL) {
 			    PQfreemem(temp);
@@ -779,3 +2729,41 @@ void _get_row_data(dbi_result_t *result, dbi_row_t *row, unsigned long long rowi
 	}
 }
 
+void _decode_hex(const char *src, size_t len, unsigned char *dest) {
+	/* decodes len hex digits into len/2 bytes. The server sends only
+	   valid digits, so we don't check. Both '0'-'9' and 'a'-'f' (or
+	   'A'-'F') have the nibble value in the low four bits, plus 9 for
+	   letters, which are the only digits with bit 6 set */
+	size_t i = 0;
+	unsigned char hi;
+	unsigned char lo;
+
+#ifdef __SSE2__
+	const __m128i mask_nibble = _mm_set1_epi8(0x0f);
+	const __m128i mask_one = _mm_set1_epi8(0x01);
+	const __m128i mask_high = _mm_set1_epi16(0x00f0);
+
+	/* 32 digits yield 16 bytes per iteration */
+	for (; i + 32 <= len; i += 32) {
+		__m128i in1 = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i in2 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+		__m128i alpha1 = _mm_and_si128(_mm_srli_epi16(in1, 6), mask_one);
+		__m128i alpha2 = _mm_and_si128(_mm_srli_epi16(in2, 6), mask_one);
+		__m128i nib1 = _mm_add_epi8(_mm_and_si128(in1, mask_nibble), _mm_add_epi8(alpha1, _mm_slli_epi16(alpha1, 3)));
+		__m128i nib2 = _mm_add_epi8(_mm_and_si128(in2, mask_nibble), _mm_add_epi8(alpha2, _mm_slli_epi16(alpha2, 3)));
+		/* each 16-bit lane holds the high nibble in its first and the
+		   low nibble in its second byte */
+		__m128i out1 = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(nib1, 4), mask_high), _mm_srli_epi16(nib1, 8));
+		__m128i out2 = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(nib2, 4), mask_high), _mm_srli_epi16(nib2, 8));
+		_mm_storeu_si128((__m128i *)(dest + i / 2), _mm_packus_epi16(out1, out2));
+	}
+#endif
+
+	for (; i + 1 < len; i += 2) {
+		hi = (unsigned char)src[i];
+		lo = (unsigned char)src[i+1];
+		hi = (hi & 0x0f) + 9 * ((hi >> 6) & 1);
+		lo = (lo & 0x0f) + 9 * ((lo >> 6) & 1);
+		dest[i/2] = (unsigned char)((hi << 4) | lo);
+	}
+}
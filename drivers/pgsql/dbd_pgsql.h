@@ -56,6 +56,106 @@
 #define PG_TYPE_TIMESTAMPTZ		1184  /* with timezone */
 #define PG_TYPE_NUMERIC			1700
 
+/* OIDs below this value are assigned to built-in objects */
+#define PG_FIRST_NORMAL_OID		16384
+
+/* domains over domains are resolved up to this depth */
+#define PG_MAX_DOMAIN_DEPTH		16
+
+/* options which are handled by the driver itself. Unlike other pgsql_foo
+   options these are not passed on to libpq. A trailing asterisk matches
+   any option name starting with the preceding characters */
+#define PGSQL_DRIVER_OPTIONS { \
+	"pgsql_extended_types", \
+	"pgsql_ping_idle", \
+	"pgsql_seq_block*", \
+	"pgsql_idle_conns", \
+	"pgsql_idle_timeout", \
+	"pgsql_lo_chunk_size", \
+	"pgsql_host_race", \
+	"pgsql_cursor_fetch", \
+	NULL }
+
+/* default size of the chunks used to stream large objects */
+#define PGSQL_LO_CHUNK_SIZE		65536
+
+/* seconds a reconnect may take if the timeout option is not set */
+#define PGSQL_RESET_TIMEOUT		30
+
+/* a user-defined type, as cached by the driver */
+typedef struct pgsql_type_s {
+	unsigned int oid;
+	unsigned int basetype;		/* base type of a domain, or 0 */
+} pgsql_type_t;
+
+/* sequence values fetched in advance by dbd_get_seq_next() */
+typedef struct pgsql_seq_block_s {
+	char *name;
+	unsigned long long *values;
+	int n_values;
+	int next;			/* next value to hand out */
+	int values_size;
+	unsigned long long last;	/* last value handed out */
+	int have_last;
+	struct pgsql_seq_block_s *next_block;
+} pgsql_seq_block_t;
+
+/* a connection to another database, kept open by dbd_select_db() */
+typedef struct pgsql_idle_conn_s {
+	char *dbname;
+	PGconn *pgconn;
+	time_t since;
+	struct pgsql_idle_conn_s *next;
+} pgsql_idle_conn_t;
+
+/* a query result which is fetched page by page from a server-side
+   cursor. The current page is the result handle of the dbi result */
+typedef struct pgsql_cursor_s {
+	dbi_result_t *result;
+	PGconn *pgconn;			/* the connection the cursor lives on,
+					   NULL once the connection was
+					   switched or reset */
+	char name[32];
+	int page_size;
+	unsigned long long first_row;	/* index of the first row of the page */
+	unsigned long long position;	/* index of the row the next FETCH
+					   returns */
+	struct pgsql_cursor_s *next;
+} pgsql_cursor_t;
+
+/* the field descriptions of a prepared statement, as returned by
+   PQdescribePrepared() */
+typedef struct pgsql_stmt_s {
+	char *name;
+	unsigned int numfields;
+	char **field_names;
+	unsigned short *field_types;
+	unsigned int *field_attribs;
+	struct pgsql_stmt_s *next;
+} pgsql_stmt_t;
+
+/* per-connection driver data. This is attached to the PGconn as libpq
+   event instance data, so it lives exactly as long as the PGconn */
+typedef struct pgsql_conn_data_s {
+	pgsql_type_t *types;		/* sorted by oid */
+	size_t n_types;
+	size_t types_size;
+	time_t last_activity;		/* last time the server answered */
+	unsigned long pings;
+	unsigned long resets;		/* reconnection attempts */
+	unsigned long failed_resets;
+	unsigned long long reset_usecs;	/* total time spent reconnecting */
+	pgsql_seq_block_t *seq_blocks;
+	pgsql_idle_conn_t *idle_conns;	/* most recently used first. This
+					   moves along with the active
+					   connection */
+	pgsql_cursor_t *cursors;	/* of all pending results. This
+					   moves along with the active
+					   connection */
+	unsigned long cursor_serial;	/* used to name the cursors */
+	pgsql_stmt_t *stmts;
+} pgsql_conn_data_t;
+
 /* list from http://www.postgresql.org/idocs/index.php?sql-keywords-appendix.html */
 
 #define PGSQL_RESERVED_WORDS { \
@@ -660,4 +760,51 @@
         "PQsetErrorVerbosity", \
         "PQtrace", \
         "PQuntrace", \
+        "lo_open", \
+        "lo_close", \
+        "lo_read", \
+        "lo_write", \
+        "lo_lseek", \
+        "lo_creat", \
+        "lo_tell", \
+        "lo_unlink", \
+        "lo_import", \
+        "lo_export", \
+        "dbd_pgsql_batch_query", \
+        "dbd_pgsql_send_query", \
+        "dbd_pgsql_send_query_params", \
+        "dbd_pgsql_consume_input", \
+        "dbd_pgsql_get_result", \
+        "dbd_pgsql_get_ping_stats", \
+        "dbd_pgsql_lo_read_stream", \
+        "dbd_pgsql_lo_write_stream", \
+        "dbd_pgsql_connect_many", \
+        "dbd_pgsql_prepare", \
+        "dbd_pgsql_execute_prepared", \
+        "dbd_pgsql_deallocate", \
+        "dbd_pgsql_get_notifies", \
         NULL}
+
+/* driver-specific functions, see PGSQL_CUSTOM_FUNCTIONS */
+
+/* receives a chunk of a large object. Return 0 to continue, anything
+   else to stop */
+typedef int (*dbd_pgsql_lo_write_func)(const char *buf, size_t len, void *user_arg);
+
+/* fills buf with up to len bytes of a large object. Return the number
+   of bytes, 0 at the end of the data, or -1 on error */
+typedef long (*dbd_pgsql_lo_read_func)(char *buf, size_t len, void *user_arg);
+
+int dbd_pgsql_batch_query(dbi_conn Conn, const char **statements, size_t n_statements, dbi_result *results, size_t *failed_idx);
+int dbd_pgsql_send_query(dbi_conn Conn, const char *statement);
+int dbd_pgsql_send_query_params(dbi_conn Conn, const char *statement, int n_params, const char * const *param_values);
+int dbd_pgsql_consume_input(dbi_conn Conn);
+dbi_result dbd_pgsql_get_result(dbi_conn Conn);
+int dbd_pgsql_get_ping_stats(dbi_conn Conn, unsigned long *pings, unsigned long *resets, unsigned long *failed_resets, unsigned long long *reset_usecs);
+long long dbd_pgsql_lo_read_stream(dbi_conn Conn, unsigned int lobj_oid, long long offset, dbd_pgsql_lo_write_func writer, void *user_arg);
+unsigned int dbd_pgsql_lo_write_stream(dbi_conn Conn, unsigned int lobj_oid, long long offset, dbd_pgsql_lo_read_func reader, void *user_arg);
+int dbd_pgsql_connect_many(dbi_conn *Conns, int n_conns, int timeout);
+int dbd_pgsql_prepare(dbi_conn Conn, const char *stmt_name, const char *statement, int n_params);
+dbi_result dbd_pgsql_execute_prepared(dbi_conn Conn, const char *stmt_name, int n_params, const char * const *param_values);
+int dbd_pgsql_deallocate(dbi_conn Conn, const char *stmt_name);
+int dbd_pgsql_get_notifies(dbi_conn Conn, PGnotify **notifies, int max_notifies, int timeout_ms);
@@ -0,0 +1,250 @@
+/*
+ * libdbi-drivers - database drivers for libdbi, the database
+ * independent abstraction layer for C.
+
+ * Copyright (C) 2001-2008, David Parker, Mark Tobenkin, Markus Hoenicka
+ * http://libdbi-drivers.sourceforge.net
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ */
+
+/* unit tests for internal helpers of the mysql driver which don't need
+   a server. The driver source is included to reach its helpers */
+
+#include "../drivers/mysql/dbd_mysql.c"
+
+#define INSERT_PREFIX "INSERT INTO t (a,b) VALUES "
+#define N_TUPLES 500
+#define MAX_ESCAPE_LEN 80
+
+int check_batch(const char *sql, size_t sql_len, size_t limit, const char **tuples, int first, int n_rows) {
+  /* compares a statement with the tuples it should hold */
+  size_t expected_len = strlen(INSERT_PREFIX);
+  const char *pos = sql + strlen(INSERT_PREFIX);
+  int i;
+
+  if (strncmp(sql, INSERT_PREFIX, strlen(INSERT_PREFIX))) {
+    return 1;
+  }
+  for (i = first; i < first + n_rows; i++) {
+    if (i > first && *pos++ != ',') {
+      return 1;
+    }
+    if (strncmp(pos, tuples[i], strlen(tuples[i]))) {
+      return 1;
+    }
+    pos += strlen(tuples[i]);
+    expected_len += strlen(tuples[i]) + (i > first ? 1 : 0);
+  }
+  if (sql_len != expected_len || strlen(sql) != sql_len) {
+    return 1;
+  }
+  /* a single tuple may exceed the limit, as it can't be split */
+  return (n_rows > 1 && sql_len > limit) ? 1 : 0;
+}
+
+int test_insert_batches(void) {
+  /* splits tuples of random length into INSERT statements the way
+     dbd_mysql_insert_rows() does, and checks that every statement
+     stays within the limit, takes as many tuples as fit, and that no
+     tuple gets lost or reordered */
+  static const size_t limits[] = {40, 64, 100, 1000, 4096};
+  char *tuples[N_TUPLES];
+  char *sql;
+  size_t sql_len;
+  size_t sql_size;
+  size_t prefix_len = strlen(INSERT_PREFIX);
+  size_t tuple_len;
+  size_t l;
+  int n_rows;
+  int first;
+  int i;
+  int j;
+  int errors = 0;
+
+  srand(2);
+  for (i = 0; i < N_TUPLES; i++) {
+    /* mostly short rows, and now and then one above the small limits */
+    tuple_len = (i % 50 == 7) ? 60 + rand() % 40 : 3 + rand() % 30;
+    tuples[i] = malloc(tuple_len + 1);
+    tuples[i][0] = '(';
+    for (j = 1; j < (int)tuple_len - 1; j++) {
+      tuples[i][j] = 'a' + (i + j) % 26;
+    }
+    tuples[i][tuple_len-1] = ')';
+    tuples[i][tuple_len] = '\0';
+  }
+
+  for (l = 0; l < sizeof(limits)/sizeof(limits[0]); l++) {
+    /* start small to exercise the buffer growth */
+    sql_size = prefix_len + 1;
+    sql = malloc(sql_size);
+    strcpy(sql, INSERT_PREFIX);
+    sql_len = prefix_len;
+    n_rows = 0;
+    first = 0;
+
+    for (i = 0; i <= N_TUPLES; i++) {
+      if (n_rows && (i == N_TUPLES || !_tuple_fits(sql_len, strlen(tuples[i]), limits[l]))) {
+	/* the statement must have taken every tuple that fits */
+	if (check_batch(sql, sql_len, limits[l], (const char **)tuples, first, n_rows)
+	    || (i < N_TUPLES && sql_len + 1 + strlen(tuples[i]) <= limits[l])) {
+	  printf("insert batches: wrong statement for rows %d-%d, limit %lu\n", first, first + n_rows - 1, (unsigned long)limits[l]);
+	  errors++;
+	}
+	sql_len = prefix_len;
+	first += n_rows;
+	n_rows = 0;
+      }
+      if (i == N_TUPLES) {
+	break;
+      }
+      if (_append_tuple(&sql, &sql_len, &sql_size, prefix_len, tuples[i], strlen(tuples[i]))) {
+	printf("insert batches: out of memory\n");
+	errors++;
+	break;
+      }
+      n_rows++;
+    }
+    if (first != N_TUPLES) {
+      printf("insert batches: %d of %d rows sent, limit %lu\n", first, N_TUPLES, (unsigned long)limits[l]);
+      errors++;
+    }
+    free(sql);
+  }
+
+  for (i = 0; i < N_TUPLES; i++) {
+    free(tuples[i]);
+  }
+  return errors;
+}
+
+int test_parse_decimal(void) {
+  /* DECIMAL strings as the server sends them, converted at the column
+     scale. len is used instead of the string length if positive */
+  static const struct {
+    const char *raw;
+    int len;
+    unsigned int scale;
+    long long expected;
+  } cases[] = {
+    {"0", 0, 0, 0LL},
+    {"0.00", 0, 2, 0LL},
+    {"123.45", 0, 2, 12345LL},
+    {"-123.45", 0, 2, -12345LL},
+    {"+7.5", 0, 1, 75LL},
+    {"-0.05", 0, 2, -5LL},
+    {".5", 0, 3, 500LL},
+    {"42", 0, 4, 420000LL},
+    {"1.2", 0, 5, 120000LL},
+    {"3.14159", 0, 2, 314LL},
+    {"999999999999999999", 0, 0, 999999999999999999LL},
+    {"-9999999999.99999999", 0, 8, -999999999999999999LL},
+    {"12.34", 4, 2, 1230LL},
+    {"12.34xyz", 5, 2, 1234LL},
+  };
+  unsigned int i;
+  long long value;
+  int errors = 0;
+
+  for (i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+    value = _parse_decimal(cases[i].raw, cases[i].len ? (size_t)cases[i].len : strlen(cases[i].raw), cases[i].scale);
+    if (value != cases[i].expected) {
+      printf("_parse_decimal: \"%s\" at scale %u gave %lld instead of %lld\n", cases[i].raw, cases[i].scale, value, cases[i].expected);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+int compare_escape(const char *src, size_t len) {
+  /* escapes src with _escape_string() and mysql_escape_string() and
+     compares the results. A guard byte catches writes past the end */
+  char expected[2*MAX_ESCAPE_LEN+1];
+  char escaped[2*MAX_ESCAPE_LEN+2];
+  unsigned long expected_len;
+  size_t escaped_len;
+
+  memset(escaped, 0x5a, sizeof(escaped));
+  expected_len = mysql_escape_string(expected, src, (unsigned long)len);
+  escaped_len = _escape_string(src, len, escaped);
+  if (escaped_len != expected_len || memcmp(escaped, expected, expected_len + 1)
+      || escaped[2*len+1] != 0x5a) {
+    return 1;
+  }
+  return 0;
+}
+
+int test_escape_string(void) {
+  /* compares _escape_string() with the client library for every
+     length around the 16-byte blocks of the SIMD loop, with each
+     special character at every position, and with random data */
+  static const char specials[] = {'\0', '\n', '\r', '\\', '\'', '"', '\032'};
+  char src[MAX_ESCAPE_LEN];
+  size_t len;
+  size_t pos;
+  unsigned int i;
+  int round;
+  int errors = 0;
+
+  for (len = 0; len <= MAX_ESCAPE_LEN; len++) {
+    memset(src, 'x', len);
+    if (compare_escape(src, len)) {
+      printf("_escape_string: wrong result for %lu plain bytes\n", (unsigned long)len);
+      errors++;
+    }
+    for (pos = 0; pos < len; pos++) {
+      for (i = 0; i < sizeof(specials); i++) {
+	src[pos] = specials[i];
+	if (compare_escape(src, len)) {
+	  printf("_escape_string: wrong result for 0x%02x at %lu of %lu bytes\n", (unsigned char)specials[i], (unsigned long)pos, (unsigned long)len);
+	  errors++;
+	}
+      }
+      src[pos] = 'x';
+    }
+  }
+
+  /* random bytes, most of them plain, including non-ASCII ones */
+  srand(3);
+  for (round = 0; round < 2000; round++) {
+    len = rand() % (MAX_ESCAPE_LEN + 1);
+    for (pos = 0; pos < len; pos++) {
+      src[pos] = (rand() % 8) ? (char)(rand() & 0xff) : specials[rand() % sizeof(specials)];
+    }
+    if (compare_escape(src, len)) {
+      printf("_escape_string: wrong result for random data of %lu bytes\n", (unsigned long)len);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+int main(void) {
+  int errors = 0;
+
+  errors += test_insert_batches();
+  errors += test_parse_decimal();
+  errors += test_escape_string();
+
+  if (errors) {
+    printf("%d mysql helper test(s) failed\n", errors);
+    return 1;
+  }
+  printf("all mysql helper tests passed\n");
+  return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * libdbi-drivers - database drivers for libdbi, the database
+ * independent abstraction layer for C.
+
+ * Copyright (C) 2001-2008, David Parker, Mark Tobenkin, Markus Hoenicka
+ * http://libdbi-drivers.sourceforge.net
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ */
+
+/* unit tests for internal helpers of the pgsql driver which don't need
+   a server. The driver source is included to reach its helpers */
+
+#include "../drivers/pgsql/dbd_pgsql.c"
+
+#define MAX_BYTES 100
+
+int test_decode_hex(void) {
+  /* encodes random data as lower and upper case hex and decodes it
+     again, for all lengths around the 32-digit blocks of the SIMD
+     loop. A guard byte catches writes past the end */
+  static const char *digits[2] = {"0123456789abcdef", "0123456789ABCDEF"};
+  unsigned char data[256];
+  unsigned char decoded[257];
+  char hex[512];
+  size_t n_bytes;
+  size_t i;
+  int upper;
+  int errors = 0;
+
+  srand(1);
+  for (n_bytes = 0; n_bytes <= MAX_BYTES; n_bytes++) {
+    for (upper = 0; upper < 2; upper++) {
+      for (i = 0; i < n_bytes; i++) {
+	data[i] = (unsigned char)(rand() & 0xff);
+	hex[2*i] = digits[upper][data[i] >> 4];
+	hex[2*i+1] = digits[upper][data[i] & 0x0f];
+      }
+      memset(decoded, 0xa5, sizeof(decoded));
+      _decode_hex(hex, 2*n_bytes, decoded);
+      if (memcmp(decoded, data, n_bytes) || decoded[n_bytes] != 0xa5) {
+	printf("_decode_hex: wrong result for %lu bytes (%s case)\n", (unsigned long)n_bytes, upper ? "upper" : "lower");
+	errors++;
+      }
+    }
+  }
+
+  /* every byte value in one run */
+  for (i = 0; i < 256; i++) {
+    data[i] = (unsigned char)i;
+    hex[2*i] = digits[i & 1][i >> 4];
+    hex[2*i+1] = digits[i & 1][i & 0x0f];
+  }
+  _decode_hex(hex, 512, decoded);
+  if (memcmp(decoded, data, 256)) {
+    printf("_decode_hex: wrong result for the byte values 0-255\n");
+    errors++;
+  }
+
+  return errors;
+}
+
+int test_is_select(void) {
+  /* statements which can run through a cursor, and those which must
+     not, like SELECT INTO and the row locking clauses */
+  static const struct {
+    const char *statement;
+    int expected;
+  } cases[] = {
+    {"SELECT * FROM t", 1},
+    {"  select a, b from t where a > 1", 1},
+    {"(SELECT 1) UNION (SELECT 2)", 1},
+    {"SELECT format, fortune, intone FROM t", 1},
+    {"SELECT * FROM t ORDER BY a FOR\tREAD ONLY", 1},
+    {"SELECTION", 0},
+    {"INSERT INTO t VALUES (1)", 0},
+    {"SELECT 1; SELECT 2", 0},
+    {"SELECT * INTO t2 FROM t", 0},
+    {"select a into temp t2 from t", 0},
+    {"SELECT * FROM t FOR UPDATE", 0},
+    {"SELECT * FROM t for share of t nowait", 0},
+    {"SELECT * FROM t FOR NO KEY UPDATE", 0},
+    {"SELECT * FROM t\nFOR  KEY SHARE SKIP LOCKED", 0},
+  };
+  unsigned int i;
+  int errors = 0;
+
+  for (i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+    if (_is_select(cases[i].statement) != cases[i].expected) {
+      printf("_is_select: wrong result for \"%s\"\n", cases[i].statement);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+int main(void) {
+  int errors = 0;
+
+  errors += test_decode_hex();
+  errors += test_is_select();
+
+  if (errors) {
+    printf("%d pgsql helper test(s) failed\n", errors);
+    return 1;
+  }
+  printf("all pgsql helper tests passed\n");
+  return 0;
+}